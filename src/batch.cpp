@@ -0,0 +1,195 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <future>
+#include <cctype>
+
+#include "batch.hpp"
+#include "utility.hpp"
+#include "profiler.hpp"
+
+
+static std::runtime_error jobError(const std::string &path, int line,
+                                   const std::string &what)
+{
+   return std::runtime_error(format_str("%s:%d: %s", path.c_str(), line,
+                                        what.c_str()));
+}
+
+
+/// Check that 'pattern' contains at most one integer conversion.
+static bool validOutput(const std::string &pattern)
+{
+   int conversions = 0;
+   for (size_t i = 0; i < pattern.size(); i++)
+   {
+      if (pattern[i] != '%') { continue; }
+      if (i+1 < pattern.size() && pattern[i+1] == '%') { i++; continue; }
+
+      // flags and width, then 'd'
+      size_t j = i+1;
+      while (j < pattern.size() &&
+             (std::isdigit(pattern[j]) || pattern[j] == '-')) { j++; }
+      if (j >= pattern.size() || pattern[j] != 'd') {
+         return false;
+      }
+      conversions++;
+      i = j;
+   }
+   return conversions <= 1;
+}
+
+
+std::vector<BatchFrame> parseBatchJob(const std::string &path,
+                                      const BatchFrame &defaults)
+{
+   std::ifstream f(path);
+   if (!f) {
+      throw std::runtime_error("Cannot open batch job " + path);
+   }
+
+   std::vector<BatchFrame> frames;
+   BatchFrame cur(defaults);
+   if (!validOutput(cur.output)) {
+      throw std::runtime_error("Invalid output pattern " + cur.output);
+   }
+
+   std::string line;
+   for (int lineNo = 1; std::getline(f, line); lineNo++)
+   {
+      std::istringstream is(line);
+      std::string token;
+
+      BatchFrame next(cur);
+      int steps = 1;
+      bool empty = true;
+
+      while (is >> token)
+      {
+         if (token[0] == '#') { break; }
+         empty = false;
+
+         size_t eq = token.find('=');
+         if (eq == std::string::npos) {
+            throw jobError(path, lineNo, "expected key=value: " + token);
+         }
+         std::string key = token.substr(0, eq), value = token.substr(eq+1);
+
+         FrameParams &p = next.params;
+         try
+         {
+            if (key == "output")
+            {
+               if (!validOutput(value)) {
+                  throw jobError(path, lineNo, "invalid output: " + value);
+               }
+               next.output = value;
+            }
+            else if (key == "rx") { p.rotateX = std::stod(value); }
+            else if (key == "ry") { p.rotateY = std::stod(value); }
+            else if (key == "zoom") { p.zoom = std::stod(value); }
+            else if (key == "clip") { p.clipMode = std::stoi(value); }
+            else if (key == "cx") { p.clipX = std::stod(value); }
+            else if (key == "cy") { p.clipY = std::stod(value); }
+            else if (key == "cz") { p.clipZ = std::stod(value); }
+            else if (key == "level") { p.tessLevel = std::stoi(value); }
+            else if (key == "explode") { p.explode = std::stoi(value); }
+            else if (key == "lines") { p.lines = std::stoi(value) != 0; }
+            else if (key == "steps") { steps = std::stoi(value); }
+            else {
+               throw jobError(path, lineNo, "unknown key: " + key);
+            }
+         }
+         catch (const std::logic_error &)
+         {
+            // std::stod/stoi failed
+            throw jobError(path, lineNo, "invalid value: " + token);
+         }
+      }
+      if (empty) { continue; }
+
+      if (steps < 1) {
+         throw jobError(path, lineNo, "steps out of range");
+      }
+      try
+      {
+         next.params.validate();
+      }
+      catch (const std::runtime_error &e)
+      {
+         throw jobError(path, lineNo, e.what());
+      }
+
+      // the first frame has nothing to interpolate from
+      if (frames.empty()) { steps = 1; }
+
+      for (int i = 1; i <= steps; i++)
+      {
+         double t = double(i) / steps;
+         auto lerp = [t](double a, double b) { return a + t*(b - a); };
+
+         BatchFrame frame(next);
+         FrameParams &p = frame.params;
+         const FrameParams &a = cur.params, &b = next.params;
+         p.rotateX = lerp(a.rotateX, b.rotateX);
+         p.rotateY = lerp(a.rotateY, b.rotateY);
+         p.zoom = lerp(a.zoom, b.zoom);
+         p.clipX = lerp(a.clipX, b.clipX);
+         p.clipY = lerp(a.clipY, b.clipY);
+         p.clipZ = lerp(a.clipZ, b.clipZ);
+
+         frame.output = format_str(next.output.c_str(), int(frames.size()));
+         frames.push_back(frame);
+      }
+      cur = next;
+   }
+   return frames;
+}
+
+
+void runBatchJob(HeadlessRenderer &renderer,
+                 const std::vector<BatchFrame> &frames)
+{
+   std::future<void> encoding;
+
+   // wait for the readback of 'frame' and encode it in the background
+   auto finish = [&](int frame)
+   {
+      QImage image = renderer.image(frame % 2);
+
+      if (encoding.valid()) {
+         encoding.get(); // one image encoded at a time, rethrows errors
+      }
+
+      std::string path = frames[frame].output;
+      encoding = std::async(std::launch::async, [image, path]()
+      {
+         if (!image.save(QString::fromStdString(path))) {
+            throw std::runtime_error("Cannot write image " + path);
+         }
+      });
+   };
+
+   ProfileZone zone("batch");
+   int n = frames.size();
+   for (int i = 0; i < n; i++)
+   {
+      Profiler::beginFrame();
+      renderer.render(frames[i].params);
+      renderer.readback(i % 2);
+
+      // the previous frame is ready once this one is issued
+      if (i > 0) { finish(i-1); }
+
+      Profiler::endFrame();
+
+      std::cout << "Frame " << i+1 << "/" << n << ": "
+                << frames[i].output << std::endl;
+   }
+   if (n > 0) { finish(n-1); }
+   if (encoding.valid()) { encoding.get(); }
+
+   std::cout << "Rendered " << n << " frames in " << zone.elapsed() << " s."
+             << std::endl;
+}
@@ -0,0 +1,49 @@
+#ifndef hogtess_batch_hpp_included__
+#define hogtess_batch_hpp_included__
+
+#include <string>
+#include <vector>
+
+#include "headless.hpp"
+
+
+/** One image of a batch job: the parameters and the output file name. */
+struct BatchFrame
+{
+   FrameParams params;
+   std::string output;
+};
+
+
+/** Parse a batch job file. Each non-empty line not starting with '#'
+ *  produces one or more frames and consists of "key=value" pairs:
+ *
+ *     output=orbit%04d.png    output file, "%d" is replaced by frame number
+ *     rx=, ry=, zoom=         view rotation and zoom (as in the window)
+ *     clip=0|1|2|3            clip plane off, marching cubes, direct,
+ *                             marching cubes on the CPU
+ *     cx=, cy=, cz=           clip plane parameters
+ *     level=, explode=        tesselation level, part explode
+ *     lines=0|1               draw element edges
+ *     steps=N                 interpolate rx, ry, zoom, cx, cy, cz from the
+ *                             previous frame in N frames (default 1)
+ *
+ *  Parameters not given keep their values from the previous line, so e.g.
+ *  an orbit is "rx=0 ry=0" followed by "ry=360 steps=360". Those of the
+ *  first line default to 'defaults' (the command line options).
+ *  Throws std::runtime_error on syntax errors and invalid parameters.
+ */
+std::vector<BatchFrame> parseBatchJob(const std::string &path,
+                                      const BatchFrame &defaults);
+
+
+/** Render all frames of a job with one renderer. The meshes are reused
+ *  between frames (see HeadlessRenderer::render), the readback of frame
+ *  N overlaps with rendering frame N+1 and frame N-1 is PNG encoded on
+ *  another thread meanwhile.
+ */
+void runBatchJob(HeadlessRenderer &renderer,
+                 const std::vector<BatchFrame> &frames);
+
+
+#endif // hogtess_batch_hpp_included__
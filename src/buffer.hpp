@@ -4,6 +4,7 @@
 //#include <iostream>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 
 #include <GL/gl.h>
 
@@ -27,6 +28,13 @@ public:
       glBindBufferBase(target, location, id_);
    }
 
+   /// Bind buffer to a non-indexed target (e.g., for indirect dispatch).
+   void bindTo(GLenum target) const
+   {
+      genBind();
+      glBindBuffer(target, id_);
+   }
+
    /// Return current buffer size.
    long size() const { return size_; }
 
@@ -54,6 +62,14 @@ public:
       discardCopy();
    }
 
+   /// Upload data to a part of the GPU buffer, which must be large enough.
+   void upload(const void* data, long size, long offset)
+   {
+      genBind();
+      glBufferSubData(target, offset, size, data);
+      discardCopy();
+   }
+
    /// Upload helper for an std::vector.
    template<typename T>
    void upload(const std::vector<T> &data)
@@ -126,4 +142,219 @@ protected:
 };
 
 
+/** A ring of 'Segments' equally sized segments of a GL_SHADER_STORAGE_BUFFER,
+ *  used for data written by the CPU every frame (or every interaction).
+ *
+ *  The buffer has immutable storage (glBufferStorage) and stays persistently
+ *  and coherently mapped, so the CPU writes directly to GPU visible memory
+ *  without glBufferSubData copies. Each use of the buffer takes the next
+ *  segment; fences make sure the CPU never overwrites a segment the GPU may
+ *  still be reading, without implicitly synchronizing the whole buffer.
+ *
+ *  Without GL 4.4 or ARB_buffer_storage, the ring falls back to a CPU
+ *  shadow copy uploaded with glBufferSubData in unmap().
+ */
+class RingBuffer
+{
+public:
+   enum { Segments = 3 };
+
+   RingBuffer()
+      : id_(0), segSize_(0), current_(0), ptr_(nullptr)
+   {
+      for (int i = 0; i < Segments; i++) { fences_[i] = 0; }
+   }
+
+   ~RingBuffer() { discard(); }
+
+   /** Start writing the next segment, at least 'size' bytes large. Waits
+       only if the GPU still uses that segment (issued 'Segments' uses ago).
+       Returns a pointer to the segment memory. */
+   void* map(long size)
+   {
+      if (size > segSize_) {
+         allocate(size);
+      }
+      current_ = (current_ + 1) % Segments;
+      wait(current_);
+      return segment(current_);
+   }
+
+   /// Finish writing the current segment (makes the data visible to GL).
+   void unmap(long size)
+   {
+      if (!persistent()) {
+         glBindBuffer(target, id_);
+         glBufferSubData(target, current_*segSize_, size, segment(current_));
+      }
+   }
+
+   /// Map, copy an std::vector and unmap.
+   template<typename T>
+   void upload(const std::vector<T> &data)
+   {
+      long size = data.size()*sizeof(T);
+      std::memcpy(map(size), data.data(), size);
+      unmap(size);
+   }
+
+   /// Bind the current segment to the given location.
+   void bind(GLuint location) const
+   {
+      glBindBufferRange(target, location, id_, current_*segSize_, segSize_);
+   }
+
+   /** Mark the current segment as used by all GL commands issued so far.
+       Must be called after the last command reading/writing the segment. */
+   void fence()
+   {
+      if (fences_[current_]) {
+         glDeleteSync(fences_[current_]);
+      }
+      fences_[current_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   }
+
+   /** Wait for the GPU to finish with the current segment (see fence())
+       and return a pointer to its contents as written by the GPU. Shader
+       writes need glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT)
+       before the fence. */
+   const void* read(long size)
+   {
+      wait(current_);
+      if (!persistent()) {
+         glBindBuffer(target, id_);
+         glGetBufferSubData(target, current_*segSize_, size,
+                            segment(current_));
+      }
+      return segment(current_);
+   }
+
+   /// Return true if the GPU has finished with the current segment.
+   bool ready()
+   {
+      GLsync f = fences_[current_];
+      if (f)
+      {
+         GLenum ret = glClientWaitSync(f, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+         if (ret == GL_TIMEOUT_EXPIRED) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   /// Bind the whole buffer to a non-indexed target (e.g., for indirect draws).
+   void bindTo(GLenum target) const
+   {
+      glBindBuffer(target, id_);
+   }
+
+   /// Return the byte offset of the current segment in the buffer.
+   long offset() const { return current_*segSize_; }
+
+   /// Return the size of one segment.
+   long size() const { return segSize_; }
+
+   /// Free the buffer.
+   void discard()
+   {
+      for (int i = 0; i < Segments; i++) {
+         wait(i);
+      }
+      if (id_)
+      {
+         if (persistent()) {
+            glBindBuffer(target, id_);
+            glUnmapBuffer(target);
+         }
+         glDeleteBuffers(1, &id_);
+         id_ = 0;
+      }
+      shadow_.clear();
+      ptr_ = nullptr;
+      segSize_ = 0;
+   }
+
+   /// Return true if persistently mapped buffers are supported.
+   static bool hasBufferStorage()
+   {
+      static int has = -1;
+      if (has < 0)
+      {
+         GLint major, minor, n;
+         glGetIntegerv(GL_MAJOR_VERSION, &major);
+         glGetIntegerv(GL_MINOR_VERSION, &minor);
+         has = (10*major + minor >= 44);
+
+         glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+         for (int i = 0; i < n && !has; i++)
+         {
+            const char* ext = (const char*) glGetStringi(GL_EXTENSIONS, i);
+            has = !std::strcmp(ext, "GL_ARB_buffer_storage");
+         }
+      }
+      return has;
+   }
+
+protected:
+   enum { target = GL_SHADER_STORAGE_BUFFER };
+
+   GLuint id_;
+   long segSize_;
+   int current_;
+   GLsync fences_[Segments];
+
+   char* ptr_; // persistent mapping
+   std::vector<char> shadow_; // fallback
+
+   bool persistent() const { return ptr_ != nullptr; }
+
+   char* segment(int i)
+   {
+      return (persistent() ? ptr_ : shadow_.data()) + i*segSize_;
+   }
+
+   void wait(int i)
+   {
+      if (fences_[i])
+      {
+         while (glClientWaitSync(fences_[i], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                 1000000000) == GL_TIMEOUT_EXPIRED) {}
+         glDeleteSync(fences_[i]);
+         fences_[i] = 0;
+      }
+   }
+
+   void allocate(long size)
+   {
+      GLint align;
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &align);
+
+      // grow geometrically to avoid frequent reallocation
+      long segSize = std::max(size, 2*segSize_);
+      segSize = (segSize + align-1) / align * align;
+
+      discard();
+      segSize_ = segSize;
+
+      glGenBuffers(1, &id_);
+      glBindBuffer(target, id_);
+
+      if (hasBufferStorage())
+      {
+         GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT |
+                            GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+         glBufferStorage(target, Segments*segSize_, NULL, flags);
+         ptr_ = (char*) glMapBufferRange(target, 0, Segments*segSize_, flags);
+      }
+      else
+      {
+         glBufferData(target, Segments*segSize_, NULL, GL_STREAM_DRAW);
+         shadow_.resize(Segments*segSize_);
+      }
+   }
+};
+
+
 #endif // hogtess_buffer_hpp_included_
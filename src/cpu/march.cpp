@@ -0,0 +1,193 @@
+#include <algorithm>
+
+#include "march.hpp"
+#include "utility.hpp"
+#include "cutplane/tables.hpp"
+
+
+static const int cornerXYZ[8][3] =
+{
+   {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+   {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+};
+
+// MC edge -> (cube corner where the edge starts, direction)
+static const int edgeOrigin[12] = { 0, 1, 3, 0, 4, 5, 7, 4, 0, 1, 2, 3 };
+static const int edgeDir[12] = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+
+
+/// Bits set for the 6 boundary planes of the element that 'v' touches.
+static inline unsigned boundaryMask(const int v[3], int level)
+{
+   unsigned mask = 0;
+   for (int i = 0; i < 3; i++)
+   {
+      if (v[i] == 0) { mask |= 1 << i; }
+      if (v[i] == level) { mask |= 8 << i; }
+   }
+   return mask;
+}
+
+
+/** Cut one element, appending to 'out' with vertex numbers relative to the
+ *  arena. 'dist' and 'edgeMap' are scratch arrays of cube(level+1) and
+ *  3*cube(level+1) entries. */
+static void marchElement(const float *grid, int level, const float *plane,
+                         const MarchingCubesTables &tables,
+                         float *dist, unsigned *edgeMap, CpuCutMesh &out)
+{
+   int level1 = level + 1;
+   int n = level1*level1*level1;
+   int stride[3] = { 1, level1, level1*level1 };
+
+   for (int i = 0; i < n; i++)
+   {
+      const float *p = grid + 4*i;
+      dist[i] = plane[0]*p[0] + plane[1]*p[1] + plane[2]*p[2] + plane[3];
+   }
+
+   // edge pass: each grid vertex owns the edges in the +x, +y, +z directions
+   for (int z = 0, i = 0; z < level1; z++)
+   for (int y = 0; y < level1; y++)
+   for (int x = 0; x < level1; x++, i++)
+   {
+      int v[3] = { x, y, z };
+      float d0 = dist[i];
+
+      for (int dir = 0; dir < 3; dir++)
+      {
+         if (v[dir] >= level) { continue; }
+
+         int j = i + stride[dir];
+         float d1 = dist[j];
+
+         // NOTE: same sign test as the cube index in the cell pass
+         if ((d0 < 0) != (d1 < 0))
+         {
+            edgeMap[3*i + dir] = out.vertices.size() / 4;
+
+            float t = d0 / (d0 - d1);
+            const float *p0 = grid + 4*i, *p1 = grid + 4*j;
+            for (int c = 0; c < 4; c++) {
+               out.vertices.push_back(p0[c]*(1.0f - t) + p1[c]*t);
+            }
+         }
+      }
+   }
+
+   // cell pass: triangles and boundary lines
+   for (int z = 0; z < level; z++)
+   for (int y = 0; y < level; y++)
+   for (int x = 0; x < level; x++)
+   {
+      int base = (z*level1 + y)*level1 + x;
+
+      int cubeIndex = 0;
+      for (int i = 0; i < 8; i++)
+      {
+         int corner = base + cornerXYZ[i][0]*stride[0]
+                           + cornerXYZ[i][1]*stride[1]
+                           + cornerXYZ[i][2]*stride[2];
+         if (dist[corner] < 0) {
+            cubeIndex |= 1 << i;
+         }
+      }
+
+      int edgeMask = tables.edgeTable[cubeIndex];
+      if (!edgeMask) { continue; }
+
+      unsigned vertex[12], emask[12];
+      for (int e = 0; e < 12; e++)
+      {
+         if (!(edgeMask & (1 << e))) { continue; }
+
+         const int *o = cornerXYZ[edgeOrigin[e]];
+         int dir = edgeDir[e];
+         int v[3] = { x + o[0], y + o[1], z + o[2] };
+         int w[3] = { v[0], v[1], v[2] };
+         w[dir]++;
+
+         int gi = (v[2]*level1 + v[1])*level1 + v[0];
+         vertex[e] = edgeMap[3*gi + dir];
+         emask[e] = boundaryMask(v, level) & boundaryMask(w, level);
+      }
+
+      const int *tri = tables.triTable[cubeIndex];
+      for (int i = 0; i < tri[15]; i += 3)
+      {
+         int a = tri[i], b = tri[i+1], c = tri[i+2];
+
+         out.indices.push_back(vertex[a]);
+         out.indices.push_back(vertex[b]);
+         out.indices.push_back(vertex[c]);
+
+         int edges[3][2] = { {a, b}, {b, c}, {c, a} };
+         for (auto &ed : edges)
+         {
+            if (emask[ed[0]] & emask[ed[1]])
+            {
+               out.lineIndices.push_back(vertex[ed[0]]);
+               out.lineIndices.push_back(vertex[ed[1]]);
+            }
+         }
+      }
+   }
+}
+
+
+void cpuMarchingCubes(const float *voxels, long numElems, int level,
+                      const float clipPlane[4], CpuCutMesh &mesh)
+{
+   const MarchingCubesTables &tables = marchingCubesTables();
+   long elemVert = cube(long(level + 1));
+
+   std::vector<CpuCutMesh> arenas(numThreads());
+
+   OMP(parallel)
+   {
+      CpuCutMesh &arena = arenas[threadNum()];
+      std::vector<float> dist(elemVert);
+      std::vector<unsigned> edgeMap(3*elemVert);
+
+      // static schedule: contiguous element ranges in thread order
+      OMP(for schedule(static))
+      for (long e = 0; e < numElems; e++)
+      {
+         marchElement(voxels + 4*e*elemVert, level, clipPlane, tables,
+                      dist.data(), edgeMap.data(), arena);
+      }
+   }
+
+   // concatenate the arenas, offsetting the vertex numbers
+   int na = arenas.size();
+   std::vector<long> vertFirst(na + 1, 0), triFirst(na + 1, 0);
+   std::vector<long> lineFirst(na + 1, 0);
+   for (int t = 0; t < na; t++)
+   {
+      vertFirst[t+1] = vertFirst[t] + arenas[t].vertices.size() / 4;
+      triFirst[t+1] = triFirst[t] + arenas[t].indices.size();
+      lineFirst[t+1] = lineFirst[t] + arenas[t].lineIndices.size();
+   }
+
+   mesh.vertices.resize(4*vertFirst[na]);
+   mesh.indices.resize(triFirst[na]);
+   mesh.lineIndices.resize(lineFirst[na]);
+
+   OMP(parallel for schedule(static, 1))
+   for (int t = 0; t < na; t++)
+   {
+      const CpuCutMesh &arena = arenas[t];
+      unsigned offset = vertFirst[t];
+
+      std::copy(arena.vertices.begin(), arena.vertices.end(),
+                mesh.vertices.begin() + 4*vertFirst[t]);
+
+      std::transform(arena.indices.begin(), arena.indices.end(),
+                     mesh.indices.begin() + triFirst[t],
+                     [offset](unsigned i) { return i + offset; });
+
+      std::transform(arena.lineIndices.begin(), arena.lineIndices.end(),
+                     mesh.lineIndices.begin() + lineFirst[t],
+                     [offset](unsigned i) { return i + offset; });
+   }
+}
@@ -0,0 +1,31 @@
+#ifndef hogtess_cpu_march_hpp_included_
+#define hogtess_cpu_march_hpp_included_
+
+#include <vector>
+
+
+/// Result of cpuMarchingCubes, laid out like the CutPlaneMesh buffers.
+struct CpuCutMesh
+{
+   std::vector<float> vertices;       // vec4 per shared cut vertex
+   std::vector<unsigned> indices;     // triangles
+   std::vector<unsigned> lineIndices; // segments on element boundaries
+};
+
+
+/** The CPU version of march.glsl: cut 'numElems' voxelized elements
+ *  (cube(level+1) vec4 vertices each, as written by voxelize.glsl or
+ *  CpuTesselator::voxelizeElements) by 'clipPlane' with marching cubes.
+ *  Each intersected voxel edge gets one vertex shared by the triangles
+ *  around it, the mesh lines are the triangle edges on the element faces.
+ *
+ *  The elements are split in contiguous ranges over the OpenMP threads.
+ *  Each thread writes to its own arena, the arenas are concatenated at the
+ *  end, so there are no atomics and the output is the same for any number
+ *  of threads.
+ */
+void cpuMarchingCubes(const float *voxels, long numElems, int level,
+                      const float clipPlane[4], CpuCutMesh &mesh);
+
+
+#endif // hogtess_cpu_march_hpp_included_
@@ -0,0 +1,90 @@
+#ifndef hogtess_simd_hpp_included_
+#define hogtess_simd_hpp_included_
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+/** A minimal float vector for the CPU kernels: AVX-512 or AVX2 (+FMA) when
+ *  the compiler targets them (e.g. -march=native, see HOGTESS_NATIVE in
+ *  CMakeLists.txt), otherwise a single float. The kernels process
+ *  VFloat::Width tesselation points at a time and pad their tables to a
+ *  multiple of the width, so there are no tail loops.
+ */
+#if defined(__AVX512F__)
+
+struct VFloat
+{
+   enum { Width = 16 };
+   __m512 v;
+
+   VFloat() {}
+   VFloat(__m512 v) : v(v) {}
+
+   static VFloat zero() { return _mm512_setzero_ps(); }
+   static VFloat set1(float x) { return _mm512_set1_ps(x); }
+   static VFloat load(const float *p) { return _mm512_loadu_ps(p); }
+   void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+   /// Return a*b + c.
+   static VFloat fma(VFloat a, VFloat b, VFloat c)
+   {
+      return _mm512_fmadd_ps(a.v, b.v, c.v);
+   }
+};
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+struct VFloat
+{
+   enum { Width = 8 };
+   __m256 v;
+
+   VFloat() {}
+   VFloat(__m256 v) : v(v) {}
+
+   static VFloat zero() { return _mm256_setzero_ps(); }
+   static VFloat set1(float x) { return _mm256_set1_ps(x); }
+   static VFloat load(const float *p) { return _mm256_loadu_ps(p); }
+   void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+   static VFloat fma(VFloat a, VFloat b, VFloat c)
+   {
+      return _mm256_fmadd_ps(a.v, b.v, c.v);
+   }
+};
+
+#else
+
+struct VFloat
+{
+   enum { Width = 1 };
+   float v;
+
+   VFloat() {}
+   VFloat(float v) : v(v) {}
+
+   static VFloat zero() { return 0.0f; }
+   static VFloat set1(float x) { return x; }
+   static VFloat load(const float *p) { return *p; }
+   void store(float *p) const { *p = v; }
+
+   static VFloat fma(VFloat a, VFloat b, VFloat c)
+   {
+      return a.v*b.v + c.v;
+   }
+};
+
+#endif
+
+
+/// Name of the instruction set used by VFloat, for log messages.
+inline const char* simdName()
+{
+   return VFloat::Width == 16 ? "AVX-512" :
+          VFloat::Width == 8 ? "AVX2" : "scalar";
+}
+
+
+#endif // hogtess_simd_hpp_included_
@@ -0,0 +1,275 @@
+#include <algorithm>
+
+#include "tesselate.hpp"
+#include "simd.hpp"
+#include "utility.hpp"
+#include "shape/shape.hpp"
+
+
+CpuTesselator::CpuTesselator(int order, const double *nodes1d)
+   : order(order), nodes1d(nodes1d)
+{}
+
+
+const CpuTesselator::Table& CpuTesselator::table(int level)
+{
+   auto it = tables.find(level);
+   if (it != tables.end()) {
+      return it->second;
+   }
+
+   int N1 = order + 1;
+   Table &tab = tables[level];
+   tab.level1 = level + 1;
+   tab.pad = roundUpMultiple(tab.level1, int(VFloat::Width));
+
+   // transpose basis[t*N1 + i] so that the points are contiguous
+   std::vector<float> basis = lagrangeTable(order, nodes1d, level);
+   tab.shapeT.assign(N1*tab.pad, 0.0f);
+   for (int t = 0; t < tab.level1; t++)
+   {
+      for (int i = 0; i < N1; i++) {
+         tab.shapeT[i*tab.pad + t] = basis[t*N1 + i];
+      }
+   }
+   return tab;
+}
+
+
+/** out[t] = sum_i a[i*astride] * S[i*pad + t] for t < pad, i < N1. This is
+ *  the contraction of one dimension, vectorized over the points t. */
+static inline void contract(const float *a, long astride, const float *S,
+                            int N1, int pad, float *out)
+{
+   for (int t = 0; t < pad; t += VFloat::Width)
+   {
+      VFloat acc = VFloat::zero();
+      for (int i = 0; i < N1; i++)
+      {
+         acc = VFloat::fma(VFloat::set1(a[i*astride]),
+                           VFloat::load(S + i*pad + t), acc);
+      }
+      acc.store(out + t);
+   }
+}
+
+
+/** Tesselate one face: C are its coefficients (vec4, C[i*N1 + j]), out the
+ *  sqr(level+1) vertices. 'partial' and 'row' are scratch arrays of 4*N1*pad
+ *  and 4*pad floats. */
+static void tesselateFace(const float *C, int N1, const float *S,
+                          int level1, int pad,
+                          float *partial, float *row, float *out)
+{
+   // contract V: partial[c][i][ty] = sum_j C[i][j][c] * shape_j(v)
+   for (int c = 0; c < 4; c++)
+   {
+      for (int i = 0; i < N1; i++) {
+         contract(C + 4*i*N1 + c, 4, S, N1, pad, partial + (c*N1 + i)*pad);
+      }
+   }
+
+   // contract U row by row, interleave the components
+   for (int ty = 0; ty < level1; ty++)
+   {
+      for (int c = 0; c < 4; c++) {
+         contract(partial + c*N1*pad + ty, pad, S, N1, pad, row + c*pad);
+      }
+      float *v = out + 4*ty*level1;
+      for (int tx = 0; tx < level1; tx++)
+      {
+         for (int c = 0; c < 4; c++) {
+            v[4*tx + c] = row[c*pad + tx];
+         }
+      }
+   }
+}
+
+
+/** Move the vertices of edges with a coarser level onto the coarse segments
+ *  (see tesselate.glsl). The coarse points themselves are not moved. */
+static void snapEdges(float *out, int level, unsigned edges)
+{
+   int level1 = level + 1;
+   for (int edge = 0; edge < 4; edge++)
+   {
+      int edgeLevel = (edges >> (8*edge)) & 0xff;
+      if (edgeLevel >= level) { continue; }
+
+      int step = level / std::max(edgeLevel, 1);
+
+      // vertex 'along' the edge
+      auto vertex = [=](int along) -> float*
+      {
+         int tx = (edge == 0 || edge == 2) ? along : (edge == 1) ? level : 0;
+         int ty = (edge == 1 || edge == 3) ? along : (edge == 2) ? level : 0;
+         return out + 4*(ty*level1 + tx);
+      };
+
+      for (int along = 0; along <= level; along++)
+      {
+         int rem = along % step;
+         if (!rem) { continue; }
+
+         const float *va = vertex(along - rem), *vb = vertex(along - rem + step);
+         float t = float(rem) / float(step);
+
+         float *v = vertex(along);
+         for (int c = 0; c < 4; c++) {
+            v[c] = va[c]*(1.0f - t) + vb[c]*t;
+         }
+      }
+   }
+}
+
+
+void CpuTesselator::tesselateFaces(const float *coefs, long numFaces,
+                                   const int *levels, const unsigned *edges,
+                                   const unsigned *offsets, float *vertices)
+{
+   int N1 = order + 1;
+   long ndof = N1*N1;
+
+   // prepare the tables of all levels before going parallel
+   std::vector<const Table*> faceTable(MaxTessLevel + 1, nullptr);
+   int maxPad = 0;
+   for (long f = 0; f < numFaces; f++)
+   {
+      if (!faceTable[levels[f]])
+      {
+         faceTable[levels[f]] = &table(levels[f]);
+         maxPad = std::max(maxPad, faceTable[levels[f]]->pad);
+      }
+   }
+
+   OMP(parallel)
+   {
+      // scratch, one per thread
+      std::vector<float> partial(4*N1*maxPad), row(4*maxPad);
+
+      OMP(for schedule(dynamic, 64))
+      for (long f = 0; f < numFaces; f++)
+      {
+         const Table &tab = *faceTable[levels[f]];
+         float *out = vertices + 4*long(offsets[f]);
+
+         tesselateFace(coefs + 4*f*ndof, N1, tab.shapeT.data(),
+                       tab.level1, tab.pad, partial.data(), row.data(), out);
+
+         if (edges) {
+            snapEdges(out, levels[f], edges[f]);
+         }
+      }
+   }
+}
+
+
+void CpuTesselator::tesselateFaces(const float *coefs, long numFaces,
+                                   int level, float *vertices)
+{
+   std::vector<int> levels(numFaces, level);
+   std::vector<unsigned> offsets(numFaces);
+   for (long f = 0; f < numFaces; f++) {
+      offsets[f] = f*sqr(level + 1);
+   }
+   tesselateFaces(coefs, numFaces, levels.data(), nullptr, offsets.data(),
+                  vertices);
+}
+
+
+void CpuTesselator::voxelizeElements(const float *coefs, const int *ranks,
+                                     const float *partMats, long begin,
+                                     long end, int level, float *vertices)
+{
+   std::vector<int> elems(end - begin);
+   for (long i = 0; i < end - begin; i++) {
+      elems[i] = begin + i;
+   }
+   voxelizeElements(coefs, ranks, partMats, elems.data(), end - begin,
+                    level, vertices);
+}
+
+
+void CpuTesselator::voxelizeElements(const float *coefs, const int *ranks,
+                                     const float *partMats, const int *elems,
+                                     long numElems, int level, float *vertices)
+{
+   int N1 = order + 1;
+   long ndof = N1*N1*N1;
+
+   const Table &tab = table(level);
+   const float *S = tab.shapeT.data();
+   int level1 = tab.level1, pad = tab.pad;
+   long elemVert = long(level1)*level1*level1;
+
+   OMP(parallel)
+   {
+      // scratch, one per thread
+      std::vector<float> sliceZ(4*N1*N1*pad), sliceY(4*N1*pad), row(4*pad);
+
+      OMP(for schedule(dynamic, 16))
+      for (long k = 0; k < numElems; k++)
+      {
+         long e = elems[k];
+         const float *C = coefs + 4*e*ndof;
+         const float *m = partMats + 16*ranks[e];
+         float *out = vertices + 4*k*elemVert;
+
+         // contract Z for all slabs: sliceZ[c][i][j][tz]
+         for (int c = 0; c < 4; c++)
+         {
+            for (int ij = 0; ij < N1*N1; ij++) {
+               contract(C + 4*ij*N1 + c, 4, S, N1, pad,
+                        sliceZ.data() + (c*N1*N1 + ij)*pad);
+            }
+         }
+
+         for (int tz = 0; tz < level1; tz++)
+         {
+            // contract Y: sliceY[c][i][ty]
+            for (int c = 0; c < 4; c++)
+            {
+               for (int i = 0; i < N1; i++)
+               {
+                  contract(sliceZ.data() + ((c*N1 + i)*N1)*pad + tz, pad,
+                           S, N1, pad, sliceY.data() + (c*N1 + i)*pad);
+               }
+            }
+
+            for (int ty = 0; ty < level1; ty++)
+            {
+               // contract X: row[c][tx]
+               for (int c = 0; c < 4; c++)
+               {
+                  contract(sliceY.data() + c*N1*pad + ty, pad, S, N1, pad,
+                           row.data() + c*pad);
+               }
+
+               // transform the positions by the part matrix
+               float *x = row.data(), *y = x + pad, *z = y + pad;
+               for (int t = 0; t < pad; t += VFloat::Width)
+               {
+                  VFloat vx = VFloat::load(x + t), vy = VFloat::load(y + t);
+                  VFloat vz = VFloat::load(z + t);
+                  for (int r = 0; r < 3; r++)
+                  {
+                     VFloat p = VFloat::set1(m[12 + r]);
+                     p = VFloat::fma(VFloat::set1(m[r]), vx, p);
+                     p = VFloat::fma(VFloat::set1(m[4 + r]), vy, p);
+                     p = VFloat::fma(VFloat::set1(m[8 + r]), vz, p);
+                     p.store(row.data() + r*pad + t);
+                  }
+               }
+
+               float *v = out + 4*level1*(level1*tz + ty);
+               for (int tx = 0; tx < level1; tx++)
+               {
+                  for (int c = 0; c < 4; c++) {
+                     v[4*tx + c] = row[c*pad + tx];
+                  }
+               }
+            }
+         }
+      }
+   }
+}
@@ -0,0 +1,68 @@
+#ifndef hogtess_cpu_tesselate_hpp_included_
+#define hogtess_cpu_tesselate_hpp_included_
+
+#include <vector>
+#include <map>
+
+
+/** CPU implementation of the face tesselation (surface/tesselate.glsl) and
+ *  the element voxelization (cutplane/voxelize.glsl). It reads the vec4
+ *  coefficient layouts of SurfaceCoefs and VolumeCoefs and writes vertices
+ *  in the layout of the GPU vertex buffers, so its results can be compared
+ *  to the shaders directly or uploaded instead of them on machines without
+ *  GL 4.3 compute shaders.
+ *
+ *  The evaluation is sum-factorized like in the shaders. Faces and elements
+ *  are distributed over OpenMP threads, each kernel is vectorized over the
+ *  tesselation points (see VFloat in simd.hpp).
+ */
+class CpuTesselator
+{
+public:
+   CpuTesselator(int order, const double *nodes1d);
+
+   /** Tesselate 'numFaces' faces with 'coefs' (4*sqr(order+1) floats per
+       face). Face f has level 'levels[f]' and its sqr(level+1) vec4
+       vertices are stored at 'vertices + 4*offsets[f]'. If 'edges' is not
+       NULL, it holds the packed edge levels of each face (8 bits per edge,
+       v = 0, u = 1, v = 1, u = 0) and the edge vertices are snapped to the
+       coarser edge levels, as in SurfaceMesh. */
+   void tesselateFaces(const float *coefs, long numFaces,
+                       const int *levels, const unsigned *edges,
+                       const unsigned *offsets, float *vertices);
+
+   /// Tesselate all faces at 'level', stored consecutively.
+   void tesselateFaces(const float *coefs, long numFaces, int level,
+                       float *vertices);
+
+   /** Voxelize elements [begin, end) of 'coefs' (4*cube(order+1) floats per
+       element) at 'level'. The cube(level+1) vec4 vertices of each element
+       are stored consecutively from 'vertices' (element 'begin' first), the
+       positions transformed by the part matrix 'partMats + 16*ranks[e]'
+       (column-major, as glm::mat4). */
+   void voxelizeElements(const float *coefs, const int *ranks,
+                         const float *partMats, long begin, long end,
+                         int level, float *vertices);
+
+   /// Voxelize the 'numElems' elements listed in 'elems', stored in order.
+   void voxelizeElements(const float *coefs, const int *ranks,
+                         const float *partMats, const int *elems,
+                         long numElems, int level, float *vertices);
+
+protected:
+   int order;
+   const double *nodes1d;
+
+   /// Shape functions at the tesselation points, shapeT[i*pad + t].
+   struct Table
+   {
+      int level1, pad;
+      std::vector<float> shapeT;
+   };
+   std::map<int, Table> tables;
+
+   const Table& table(int level);
+};
+
+
+#endif // hogtess_cpu_tesselate_hpp_included_
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cmath>
+
+#include "bvh.hpp"
+#include "utility.hpp"
+
+
+static const int LeafSize = 4;
+
+
+void ElementBVH::build(const VolumeCoefs &coefs, int numRanks)
+{
+   numElements_ = coefs.numElements();
+
+   // sort the elements by rank
+   elems_.resize(numElements_);
+   for (int i = 0; i < numElements_; i++) {
+      elems_[i] = i;
+   }
+   std::stable_sort(elems_.begin(), elems_.end(),
+      [&](int a, int b)
+      {
+         return coefs.elemRanks().data<int>(a) <
+                coefs.elemRanks().data<int>(b);
+      });
+
+   nodes_.clear();
+   nodes_.reserve(2*divRoundUp(numElements_, LeafSize) + numRanks);
+   roots_.assign(numRanks, -1);
+
+   // build a separate tree for each rank
+   for (int begin = 0, end; begin < numElements_; begin = end)
+   {
+      int rank = coefs.elemRanks().data<int>(elems_[begin]);
+      for (end = begin + 1; end < numElements_ &&
+           coefs.elemRanks().data<int>(elems_[end]) == rank; end++) {}
+
+      roots_[rank] = buildNode(coefs, begin, end);
+   }
+}
+
+
+int ElementBVH::buildNode(const VolumeCoefs &coefs, int begin, int end)
+{
+   // bounding box of the node, bounding box of the element centers
+   BBox<float> box, cbox;
+   for (int i = begin; i < end; i++)
+   {
+      const BBox<float> &b = coefs.boundingBox(elems_[i]);
+      for (int j = 0; j < 3; j++)
+      {
+         box.update(b.min[j], j);
+         box.update(b.max[j], j);
+         cbox.update(0.5f*(b.min[j] + b.max[j]), j);
+      }
+   }
+
+   int index = nodes_.size();
+   nodes_.emplace_back();
+   {
+      Node &node = nodes_.back();
+      for (int j = 0; j < 3; j++)
+      {
+         node.center[j] = 0.5f*(box.min[j] + box.max[j]);
+         node.extent[j] = 0.5f*(box.max[j] - box.min[j]);
+      }
+      node.first = begin;
+      node.count = end - begin;
+   }
+
+   if (end - begin <= LeafSize) {
+      return index;
+   }
+
+   // split at the median along the longest axis of the centers
+   int axis = 0;
+   for (int j = 1; j < 3; j++)
+   {
+      if (cbox.max[j] - cbox.min[j] > cbox.max[axis] - cbox.min[axis]) {
+         axis = j;
+      }
+   }
+
+   int mid = (begin + end) / 2;
+   std::nth_element(elems_.begin() + begin, elems_.begin() + mid,
+                    elems_.begin() + end,
+      [&](int a, int b)
+      {
+         const BBox<float> &ba = coefs.boundingBox(a);
+         const BBox<float> &bb = coefs.boundingBox(b);
+         return ba.min[axis] + ba.max[axis] < bb.min[axis] + bb.max[axis];
+      });
+
+   nodes_[index].count = 0;
+
+   // left child follows immediately (depth-first order)
+   buildNode(coefs, begin, mid);
+   int right = buildNode(coefs, mid, end);
+
+   nodes_[index].first = right;
+   return index;
+}
+
+
+int ElementBVH::cut(const glm::vec4 &clipPlane, const Buffer &bufPartMat,
+                    int *elemIndices, float eps) const
+{
+   int n = 0;
+   std::vector<int> stack;
+
+   for (int rank = 0; rank < (int) roots_.size(); rank++)
+   {
+      if (roots_[rank] < 0) { continue; }
+
+      // transform the plane to the local space of the rank:
+      // dot(mat*x, plane) == dot(x, transpose(mat)*plane)
+      const glm::mat4 &mat = bufPartMat.data<glm::mat4>(rank);
+      glm::vec4 plane = glm::transpose(mat) * clipPlane;
+
+      stack.push_back(roots_[rank]);
+      while (stack.size())
+      {
+         const Node &node = nodes_[stack.back()];
+         stack.pop_back();
+
+         // signed distance of the box center and the projected box radius
+         float d = plane.w, r = 0;
+         for (int j = 0; j < 3; j++)
+         {
+            d += plane[j] * node.center[j];
+            r += std::abs(plane[j]) * node.extent[j];
+         }
+
+         // same criterion as boxCut(): some corner > -eps, some corner < eps
+         if (d + r <= -eps || d - r >= eps) {
+            continue;
+         }
+
+         if (node.count)
+         {
+            for (int i = 0; i < node.count; i++) {
+               elemIndices[n++] = elems_[node.first + i];
+            }
+         }
+         else
+         {
+            stack.push_back(node.first);
+            stack.push_back(&node - nodes_.data() + 1);
+         }
+      }
+   }
+
+   return n;
+}
@@ -0,0 +1,53 @@
+#ifndef hogtess_bvh_hpp_included__
+#define hogtess_bvh_hpp_included__
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "input/input.hpp"
+#include "buffer.hpp"
+
+
+/** Bounding volume hierarchy over the element bounding boxes, one tree per
+ *  rank, so that the (per rank) explode transform can be applied to the
+ *  cutting plane instead of to the boxes. Finding the elements intersected
+ *  by a plane then costs roughly O(number of cut elements).
+ */
+class ElementBVH
+{
+public:
+   ElementBVH() : numElements_(0) {}
+
+   /// Build the trees from VolumeCoefs::boundingBox (after extract()).
+   void build(const VolumeCoefs &coefs, int numRanks);
+
+   /// Number of elements the BVH was built for.
+   int numElements() const { return numElements_; }
+
+   /** Store to 'elemIndices' the elements whose (transformed) bounding box
+       intersects 'clipPlane'. The transformation of each rank is taken from
+       'bufPartMat'. Returns the number of elements found. */
+   int cut(const glm::vec4 &clipPlane, const Buffer &bufPartMat,
+           int *elemIndices, float eps = 1e-3) const;
+
+protected:
+   struct Node
+   {
+      float center[3], extent[3];
+      int first; // leaf: first index in elems_, inner node: right child
+      int count; // leaf: number of elements, inner node: 0
+   };
+   // NOTE: nodes are stored in depth-first order, the left child of an
+   // inner node immediately follows its parent
+
+   std::vector<Node> nodes_;
+   std::vector<int> elems_;
+   std::vector<int> roots_; // per rank, -1 if the rank has no elements
+   int numElements_;
+
+   int buildNode(const VolumeCoefs &coefs, int begin, int end);
+};
+
+
+#endif // hogtess_bvh_hpp_included__
@@ -0,0 +1,90 @@
+#line 2
+
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer bufBoxes
+{
+   float boxes[]; // float[numElements][6]: min xyz, max xyz
+};
+
+layout(std430, binding = 1) buffer bufRanks
+{
+   int elemRank[];
+};
+
+layout(std430, binding = 2) buffer bufPartMat
+{
+   mat4 matrices[];
+};
+
+layout(std430, binding = 3) buffer bufElemIndices
+{
+   uint elemIndices[];
+};
+
+// indirect dispatch commands for voxelize and march, and the element counts
+layout(std430, binding = 4) buffer bufDispatch
+{
+   uint voxelizeGroups[3], edgeGroups[3], marchGroups[3];
+   uint numElems, totalElems;
+};
+
+uniform vec4 clipPlane;
+uniform uint numElements;
+
+// number of elements that fit in the voxel buffer
+uniform uint maxElems;
+uniform int level;
+
+
+#if FINALIZE
+
+// convert the number of surviving elements to dispatch sizes
+void main()
+{
+   uint n = min(totalElems, maxElems);
+   numElems = n;
+
+   uint l = uint(level);
+   voxelizeGroups[0] = n; // one work group per element
+   voxelizeGroups[1] = 1;
+   voxelizeGroups[2] = 1;
+
+   edgeGroups[0] = l+1;
+   edgeGroups[1] = l+1;
+   edgeGroups[2] = (l+1)*n;
+
+   marchGroups[0] = l;
+   marchGroups[1] = l;
+   marchGroups[2] = l*n;
+}
+
+#else
+
+void main()
+{
+   uint elem = gl_GlobalInvocationID.x;
+   if (elem >= numElements) { return; }
+
+   vec3 bmin = vec3(boxes[6*elem], boxes[6*elem+1], boxes[6*elem+2]);
+   vec3 bmax = vec3(boxes[6*elem+3], boxes[6*elem+4], boxes[6*elem+5]);
+
+   // transform the plane to the local space of the element's rank
+   vec4 plane = transpose(matrices[elemRank[elem]]) * clipPlane;
+
+   // signed distance of the box center and the projected box radius
+   float d = dot(plane.xyz, 0.5*(bmin + bmax)) + plane.w;
+   float r = dot(abs(plane.xyz), 0.5*(bmax - bmin));
+
+   // same criterion as in ElementBVH::cut
+   const float eps = 1e-3;
+   if (d + r > -eps && d - r < eps)
+   {
+      uint pos = atomicAdd(totalElems, 1);
+      elemIndices[pos] = elem;
+   }
+}
+
+#endif // FINALIZE
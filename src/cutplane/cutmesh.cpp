@@ -1,15 +1,27 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
 #include <glm/gtc/type_ptr.hpp>
 
 #include "cutmesh.hpp"
 #include "utility.hpp"
+#include "profiler.hpp"
 #include "shape/shape.hpp"
 #include "palette.hpp"
+#include "surface/surface.hpp"
+#include "cpu/tesselate.hpp"
+#include "cpu/march.hpp"
 
 #include "shape/shape.glsl.hpp"
+#include "cutplane/cull.glsl.hpp"
 #include "cutplane/voxelize.glsl.hpp"
 #include "cutplane/march.glsl.hpp"
 #include "cutplane/draw.glsl.hpp"
 #include "cutplane/lines.glsl.hpp"
+#include "cutplane/direct.glsl.hpp"
+#include "cutplane/directdraw.glsl.hpp"
 
 #include "tables.hpp"
 
@@ -20,14 +32,62 @@ void CutPlaneMesh::initializeGL(int order)
 
    Definitions defs;
    defs("P", std::to_string(order))
+       ("MAX_LEVEL", std::to_string(MaxTessLevel))
        ("PALETTE_SIZE", std::to_string(RGB_Palette_3_Size));
 
+   Definitions cullDefs(defs), cullFinalizeDefs(defs);
+   cullDefs("FINALIZE", "0");
+   cullFinalizeDefs("FINALIZE", "1");
+
+   progCull.link(
+      ComputeShader(version, {shaders::cutplane::cull}, cullDefs));
+
+   progCullFinalize.link(
+      ComputeShader(version, {shaders::cutplane::cull}, cullFinalizeDefs));
+
+   // stage the element coefficients in shared memory if they fit next to
+   // the basis and the slabs (up to P = 10 with the 32 KB minimum)
+   GLint maxShared;
+   glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxShared);
+
+   int n1 = order+1;
+   int sharedBytes = sizeof(float)*(MaxTessLevel+1)*n1
+                     + 4*sizeof(float)*(n1*n1*n1 + n1*n1 + n1*(MaxTessLevel+1));
+   const char *stage = (sharedBytes <= maxShared) ? "1" : "0";
+
+   Definitions voxelizeDefs(defs), indirectDefs(defs);
+   voxelizeDefs("INDIRECT", "0")("STAGE_COEFS", stage);
+   indirectDefs("INDIRECT", "1")("STAGE_COEFS", stage);
+
    progVoxelize.link(
       ComputeShader(version,
-         {shaders::shape, shaders::cutplane::voxelize}, defs));
+         {shaders::cutplane::voxelize}, voxelizeDefs));
+
+   progVoxelizeIndirect.link(
+      ComputeShader(version,
+         {shaders::cutplane::voxelize}, indirectDefs));
+
+   Definitions edgeDefs(defs), marchDefs(defs), finalizeDefs(defs);
+   edgeDefs("PASS", "0");
+   marchDefs("PASS", "1");
+   finalizeDefs("PASS", "2");
+
+   progEdges.link(
+      ComputeShader(version, {shaders::cutplane::march}, edgeDefs));
 
    progMarch.link(
-      ComputeShader(version, {shaders::cutplane::march}, defs));
+      ComputeShader(version, {shaders::cutplane::march}, marchDefs));
+
+   progFinalize.link(
+      ComputeShader(version, {shaders::cutplane::march}, finalizeDefs));
+
+   progDirect.link(
+      ComputeShader(version,
+         {shaders::shape, shaders::cutplane::direct}, defs));
+
+   progDirectDraw.link(
+      VertexShader(version, {shaders::cutplane::directdraw}, defs),
+      FragmentShader(version, {shaders::cutplane::directdraw}, defs));
 
    progDraw.link(
       VertexShader(version, {shaders::cutplane::draw}, defs),
@@ -37,184 +97,618 @@ void CutPlaneMesh::initializeGL(int order)
       VertexShader(version, {shaders::cutplane::lines}, defs),
       FragmentShader(version, {shaders::cutplane::lines}, defs));
 
-   // adjust and upload the tables
-   for (int i = 0, j; i < 256; i++)
-   {
-      for (j = 0; mcTables.triTable[i][j] != -1; j++) {}
-      // store vertex count
-      mcTables.triTable[i][15] = j;
-   }
-   bufTables.upload(&mcTables, sizeof(mcTables));
+   // upload the tables
+   bufTables.upload(&marchingCubesTables(), sizeof(MarchingCubesTables));
 
    // create an empty VAO
    glGenVertexArrays(1, &vao);
 }
 
 
-bool boxCut(const BBox<float> &box, const glm::vec4 clipPlane,
-            const glm::mat4 &mat, float eps = 1e-3)
+static const long MB = 1024*1024;
+
+
+void CutPlaneMesh::compute(const glm::vec4 &clipPlane,
+                           const Buffer &bufPartMat,
+                           int level)
 {
-   float corners[8][3] =
+   PROFILE_ZONE("cut plane");
+
+   subdivLevel = level;
+   this->clipPlane = clipPlane;
+   partMat = &bufPartMat;
+
+   // basis table for the tesselation points, uploaded once per level
+   if (basisLevel != level)
    {
-      { box.min[0], box.min[1], box.min[2] },
-      { box.max[0], box.min[1], box.min[2] },
-      { box.min[0], box.max[1], box.min[2] },
-      { box.max[0], box.max[1], box.min[2] },
-      { box.min[0], box.min[1], box.max[2] },
-      { box.max[0], box.min[1], box.max[2] },
-      { box.min[0], box.max[1], box.max[2] },
-      { box.max[0], box.max[1], box.max[2] }
-   };
+      bufBasis.upload(lagrangeTable(solution.order(), solution.nodes1d(),
+                                    level));
+      basisLevel = level;
+   }
 
-   int pos = 0, neg = 0;
-   for (int i = 0; i < 8; i++)
+   if (gpuCulling && !direct && !cpu)
    {
-      glm::vec4 corner(corners[i][0], corners[i][1], corners[i][2], 1);
+      cullGPU(level);
+      march();
+      return;
+   }
+
+   // STEP 1: determine which elements need to be processed. It's the ones
+   //         whose bounding box intersects the clipping plane
 
-      float d = dot(mat*corner, clipPlane);
+   // the BVH is built once, after the coefficients are extracted
+   if (bvh.numElements() != coefs.numElements())
+   {
+      ProfileZone zone("build BVH");
+      bvh.build(coefs, solution.numRanks());
+      std::cout << "Built element BVH in " << zone.elapsed() << " s."
+                << std::endl;
+   }
 
-      if (d > -eps) { pos++; }
-      if (d < eps) { neg++; }
+   cutElems.resize(std::max(coefs.numElements(), 1));
+   numElems = bvh.cut(clipPlane, bufPartMat, cutElems.data());
+   maxElems = numElems;
 
-      if (pos && neg) { return true; }
+   if (direct)
+   {
+      computeDirect(level);
+      return;
+   }
+   if (cpu)
+   {
+      computeCPU(level);
+      return;
+   }
+
+
+   // STEP 2: compute the vertices of a 3D subdivision of selected elements,
+   //         except those already in the voxel cache
+
+   updateVoxelCache(bufPartMat, level);
+
+   // write the slots of all cut elements (for march) directly to the
+   // (persistently mapped) ring segment
+   int *slots = (int*) bufSlots.map(sizeof(int)*std::max(numElems, 1));
+
+   missElems.clear();
+   for (int i = 0; i < numElems; i++)
+   {
+      int slot = voxelCache.find(cutElems[i]);
+      if (slot < 0)
+      {
+         slot = voxelCache.insert(cutElems[i]);
+         missElems.push_back(cutElems[i]);
+      }
+      slots[i] = slot;
+   }
+   bufSlots.unmap(sizeof(int)*numElems);
+
+   // elements to voxelize, followed by their slots
+   int numMiss = missElems.size();
+   int *elemIndices = (int*) bufElemIndices.map(2*sizeof(int)*
+                                                std::max(numMiss, 1));
+   for (int i = 0; i < numMiss; i++)
+   {
+      elemIndices[i] = missElems[i];
+      elemIndices[numMiss + i] = voxelCache.find(missElems[i]);
    }
+   bufElemIndices.unmap(2*sizeof(int)*numMiss);
 
-   return false; // all on positive or all on negative side
+   if (numMiss)
+   {
+      progVoxelize.use();
+      glUniform1i(progVoxelize.uniform("level"), level);
+      glUniform1i(progVoxelize.uniform("numElems"), numMiss);
+
+
+      coefs.buffer().bind(0);
+      bufElemIndices.bind(1);
+      bufVertices.bind(2);
+      coefs.elemRanks().bind(3);
+      bufPartMat.bind(4);
+      bufBasis.bind(6);
+
+      // launch the compute shader
+      GPU_ZONE("voxelize");
+      glDispatchCompute(numMiss, 1, 1); // one work group per element
+      glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+   }
+
+   bufElemIndices.fence();
+
+
+   // STEP 3: use marching cubes to extract the mesh of the cut plane
+
+   march();
 }
 
 
-void CutPlaneMesh::compute(const glm::vec4 &clipPlane,
-                           const Buffer &bufPartMat,
-                           int level)
+/** Direct cut of the elements in 'cutElems': no voxelization and no marching
+ *  cubes. Each element is reduced to a 1D polynomial along its dominant
+ *  axis at each point of a 2D (level+1)^2 grid, whose root is the cut
+ *  vertex. Grid vertices with no root inside the element get a negative
+ *  trim value and are clipped away by gl_ClipDistance when drawing.
+ */
+void CutPlaneMesh::computeDirect(int level)
 {
-   const long MB = 1024*1024;
+   int nv = sqr(level+1);
 
-   subdivLevel = level;
+   int *elemIndices = (int*) bufElemIndices.map(sizeof(int)*
+                                                std::max(numElems, 1));
+   std::copy(cutElems.begin(), cutElems.begin() + numElems, elemIndices);
+   bufElemIndices.unmap(sizeof(int)*numElems);
 
-   // STEP 1: determine which elements need to be processed. It's the ones
-   //         whose bounding box intersects the clipping plane
+   // the direct cut shares bufVertices with the voxel cache
+   voxelCache.reset(0, 0);
+
+   long vbSize = 2*4*sizeof(float)*nv*long(numElems);
+   if (bufVertices.size() < vbSize)
+   {
+      std::cout << "Cut vertex buffer size: " << double(vbSize)/MB << " MB."
+                << std::endl;
+      bufVertices.resize(vbSize);
+   }
+
+   if (directLevel != level)
+   {
+      makeQuadFaceIndexBuffers(level, bufDirectIndices, bufDirectLines);
+      directLevel = level;
+   }
+
+   progDirect.use();
+   glUniform4fv(progDirect.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   glUniform1i(progDirect.uniform("level"), level);
+
+   lagrangeUniforms(progDirect, solution.order(), solution.nodes1d());
+   bernsteinUniforms(progDirect, solution.order(), solution.nodes1d());
+
+   coefs.buffer().bind(0);
+   bufElemIndices.bind(1);
+   bufVertices.bind(2);
+   coefs.elemRanks().bind(3);
+   partMat->bind(4);
+   bufBasis.bind(5);
+
+   // one work group per element
+   GPU_ZONE("direct cut");
+   if (numElems) {
+      glDispatchCompute(numElems, 1, 1);
+   }
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+   bufElemIndices.fence();
 
-   std::vector<int> elemIndices;
-   for (int i = 0; i < coefs.numElements(); i++)
+   marchPending = false;
+}
+
+
+/** Voxelization and marching cubes of the elements in 'cutElems' on the
+ *  CPU. The elements are processed in chunks to bound the voxel memory, the
+ *  mesh is uploaded to the buffers used by draw(), with exact counts.
+ */
+void CutPlaneMesh::computeCPU(int level)
+{
+   // the coefficients only live on the GPU, download them once
+   long size = 4L*coefs.numElements()*coefs.numDofs();
+   if (long(hostCoefs.size()) != size)
    {
-      // get transform for element i
-      int rank = coefs.elemRanks().data<int>(i);
-      const glm::mat4 &mat = bufPartMat.data<glm::mat4>(rank);
+      hostCoefs.resize(size);
+      coefs.buffer().download(hostCoefs.data(), size*sizeof(float));
+   }
+
+   const int *ranks = (const int*) coefs.elemRanks().data();
+   const float *mats = (const float*) partMat->data();
+
+   const long chunk = 4096;
+   long elemVert = cube(long(level+1));
+   std::vector<float> voxels(4*elemVert*std::min(chunk, long(numElems)));
+
+   CpuTesselator tess(solution.order(), solution.nodes1d());
+   CpuCutMesh mesh, part;
+   double tVoxelize = 0, tMarch = 0;
+
+   for (long first = 0; first < numElems; first += chunk)
+   {
+      long n = std::min(chunk, numElems - first);
 
-      // check intersection with cutting plane
-      if (boxCut(coefs.boundingBox(i), clipPlane, mat))
       {
-         elemIndices.push_back(i);
+         ProfileZone zone("voxelize (CPU)");
+         tess.voxelizeElements(hostCoefs.data(), ranks, mats,
+                               cutElems.data() + first, n, level,
+                               voxels.data());
+         tVoxelize += zone.elapsed();
       }
+      {
+         ProfileZone zone("march (CPU)");
+         cpuMarchingCubes(voxels.data(), n, level, glm::value_ptr(clipPlane),
+                          part);
+         tMarch += zone.elapsed();
+      }
+
+      // append, offsetting the vertex numbers
+      unsigned offset = mesh.vertices.size() / 4;
+      mesh.vertices.insert(mesh.vertices.end(),
+                           part.vertices.begin(), part.vertices.end());
+      for (unsigned i : part.indices) {
+         mesh.indices.push_back(i + offset);
+      }
+      for (unsigned i : part.lineIndices) {
+         mesh.lineIndices.push_back(i + offset);
+      }
+   }
+
+   bufCutVertices.resize(std::max(bufCutVertices.size(), 1*MB));
+   bufIndices.resize(std::max(bufIndices.size(), 1*MB));
+   bufLineIndices.resize(std::max(bufLineIndices.size(), MB/4));
+
+   bufCutVertices.upload(mesh.vertices);
+   bufIndices.upload(mesh.indices);
+   bufLineIndices.upload(mesh.lineIndices);
+
+   // draw commands with the exact counts, nothing to verify later
+   Counters *cnt = (Counters*) bufCounters.map(sizeof(Counters));
+   std::memset(cnt, 0, sizeof(Counters));
+   cnt->triCommand[0] = cnt->totalIndices = mesh.indices.size();
+   cnt->lineCommand[0] = cnt->totalLineIndices = mesh.lineIndices.size();
+   cnt->triCommand[1] = cnt->lineCommand[1] = 1; // instance count
+   cnt->totalVertices = mesh.vertices.size() / 4;
+   cnt->totalElems = numElems;
+   bufCounters.unmap(sizeof(Counters));
+
+   marchPending = false;
+
+   std::cout << "CPU cut: " << numElems << " elements, voxelized in "
+             << tVoxelize << " s, marching cubes " << tMarch << " s, "
+             << mesh.indices.size() / 3 << " triangles." << std::endl;
+}
+
+
+void CutPlaneMesh::drawDirect(const glm::mat4 &mvp)
+{
+   int nTri = 2*sqr(directLevel);
+
+   progDirectDraw.use();
+   glUniformMatrix4fv(progDirectDraw.uniform("mvp"), 1, GL_FALSE,
+                      glm::value_ptr(mvp));
+   glUniform1i(progDirectDraw.uniform("nElemVert"), sqr(directLevel+1));
+   glUniform3fv(progDirectDraw.uniform("palette"), RGB_Palette_3_Size,
+                (const float*) RGB_Palette_3);
+
+   bufVertices.bind(0);
+   bufDirectIndices.bind(1);
+
+   glEnable(GL_CLIP_DISTANCE0);
+
+   GPU_ZONE("draw direct cut");
+   glBindVertexArray(vao);
+   glDrawArraysInstanced(GL_TRIANGLES, 0, 3*nTri, numElems);
+
+   glDisable(GL_CLIP_DISTANCE0);
+}
+
+
+/** Invalidate the voxel cache if the level or the part matrices (explode)
+ *  have changed, and make sure it can hold all 'numElems' cut elements.
+ *  The cache has as many slots as fit in the voxel budget.
+ */
+void CutPlaneMesh::updateVoxelCache(const Buffer &bufPartMat, int level)
+{
+   const glm::mat4 *mat = (const glm::mat4*) bufPartMat.data();
+   int nr = solution.numRanks();
+
+   bool valid = (level == cacheLevel) &&
+                (voxelCache.numKeys() == coefs.numElements()) &&
+                (int(cacheMatrices.size()) == nr) &&
+                !std::memcmp(cacheMatrices.data(), mat, nr*sizeof(glm::mat4));
+
+   long elemSize = 4*sizeof(float)*cube(level+1);
+   int slots = voxelCache.numSlots();
+
+   if (!valid)
+   {
+      // the budget determines the number of slots
+      slots = std::min(long(coefs.numElements()), voxelBudget/elemSize);
+   }
+   if (slots < numElems)
+   {
+      // a single cut doesn't fit in the budget, grow and start over
+      slots = std::min(coefs.numElements(), numElems + numElems/2);
+      valid = false;
    }
-   int numElems = elemIndices.size();
 
-   bufElemIndices.upload(elemIndices);
+   if (!valid || bufVertices.size() < slots*elemSize)
+   {
+      voxelCache.reset(coefs.numElements(), slots);
+      cacheLevel = level;
+      cacheMatrices.assign(mat, mat + nr);
 
+      long vbSize = std::max(slots*elemSize, long(elemSize));
+      if (bufVertices.size() != vbSize)
+      {
+         std::cout << "Voxel buffer size: " << double(vbSize)/MB << " MB."
+                   << std::endl;
+         bufVertices.resize(vbSize);
+      }
+   }
+}
 
-   // STEP 2: compute the vertices of a 3D subdivision of selected elements
 
-   progVoxelize.use();
-   glUniform1i(progVoxelize.uniform("level"), level);
-   glUniform1f(progVoxelize.uniform("invLevel"), 1.0 / level);
-   glUniform1i(progVoxelize.uniform("numElems"), numElems);
+/** Steps 1 and 2 of compute(), done entirely on the GPU: a compute shader
+ *  tests the element boxes against the plane and compacts the survivors
+ *  with an atomic counter, then the voxelization is dispatched indirectly.
+ *  The number of elements is never read back here; if the voxel buffer
+ *  turns out to be too small, checkOverflow() enlarges it and recomputes.
+ */
+void CutPlaneMesh::cullGPU(int level)
+{
+   GPU_ZONE("cull and voxelize");
 
-   lagrangeUniforms(progVoxelize, solution.order(), solution.nodes1d());
+   int ne = coefs.numElements();
 
-   int lsize[3];
-   progVoxelize.localSize(lsize);
-   int sizeX = roundUpMultiple(numElems*(level+1), lsize[0]);
+   // the voxels are not tracked by the cache here
+   voxelCache.reset(0, 0);
 
-   // prepare a buffer for voxel vertices, try to reuse the buffer if possible
-   long vbSize = 4*sizeof(float)*sizeX*sqr(level+1);
+   // number of elements that fit in the voxel buffer (at least a few)
+   long elemSize = 4*sizeof(float)*cube(level+1);
+   long vbSize = elemSize*std::min(ne, 64);
    if (bufVertices.size() < vbSize)
    {
       std::cout << "Voxel buffer size: " << double(vbSize)/MB << " MB." << std::endl;
       bufVertices.resize(vbSize);
    }
+   maxElems = std::min(bufVertices.size()/elemSize, long(ne));
+
+   if (bufCullIndices.size() < long(sizeof(int))*ne) {
+      bufCullIndices.resize(sizeof(int)*std::max(ne, 1));
+   }
+
+   Dispatch zero;
+   std::memset(&zero, 0, sizeof(zero));
+   bufDispatch.upload(&zero, sizeof(zero));
+
+   // STEP 1: cull and compact
+   progCull.use();
+   glUniform4fv(progCull.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   glUniform1ui(progCull.uniform("numElements"), ne);
+
+   coefs.elemBoxes().bind(0);
+   coefs.elemRanks().bind(1);
+   partMat->bind(2);
+   bufCullIndices.bind(3);
+   bufDispatch.bind(4);
+
+   int csize[3];
+   progCull.localSize(csize);
+   glDispatchCompute(divRoundUp(ne, csize[0]), 1, 1);
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+   progCullFinalize.use();
+   glUniform1ui(progCullFinalize.uniform("maxElems"), maxElems);
+   glUniform1i(progCullFinalize.uniform("level"), level);
+
+   bufDispatch.bind(4);
+   glDispatchCompute(1, 1, 1);
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+   // STEP 2: voxelize the selected elements
+   progVoxelizeIndirect.use();
+   glUniform1i(progVoxelizeIndirect.uniform("level"), level);
 
    coefs.buffer().bind(0);
-   bufElemIndices.bind(1);
+   bufCullIndices.bind(1);
    bufVertices.bind(2);
    coefs.elemRanks().bind(3);
-   bufPartMat.bind(4);
+   partMat->bind(4);
+   bufDispatch.bind(5);
+   bufBasis.bind(6);
 
-   // launch the compute shader
-   int groupsX = divRoundUp((level+1)*numElems, lsize[0]);
-   glDispatchCompute(groupsX, level+1, level+1);
-   glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+   bufDispatch.bindTo(GL_DISPATCH_INDIRECT_BUFFER);
+   glDispatchComputeIndirect(offsetof(Dispatch, voxelizeGroups));
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
 
 
-   // STEP 3: use marching cubes to extract the mesh of the cut plane
+void CutPlaneMesh::march()
+{
+   GPU_ZONE("march");
 
-   while (1)
+   int level = subdivLevel;
+
+   // start with big enough buffers
+   bufCutVertices.resize(std::max(bufCutVertices.size(), 1*MB));
+   bufIndices.resize(std::max(bufIndices.size(), 1*MB));
+   bufLineIndices.resize(std::max(bufLineIndices.size(), MB/4));
+
+   // one (possible) cut vertex per voxel edge of the cut elements
+   long mapSize = 3*sizeof(GLuint)*cube(level+1)*long(std::max(maxElems, 1u));
+   if (bufEdgeMap.size() < mapSize) {
+      bufEdgeMap.resize(mapSize);
+   }
+
+   // capacity in vertices, whole triangles and whole line segments
+   GLuint maxVertices = bufCutVertices.size() / (4*sizeof(float));
+   GLuint maxIndices = bufIndices.size() / sizeof(GLuint) / 3 * 3;
+   GLuint maxLineIndices = bufLineIndices.size() / sizeof(GLuint) / 2 * 2;
+
+   // reset the atomic counters and the draw commands
+   Counters *cnt = (Counters*) bufCounters.map(sizeof(Counters));
+   std::memset(cnt, 0, sizeof(Counters));
+   cnt->triCommand[1] = cnt->lineCommand[1] = 1; // instance count
+   cnt->totalElems = numElems;
+   bufCounters.unmap(sizeof(Counters));
+
+   if (gpuCulling)
    {
-      // start with big enough buffers
-      bufTriangles.resize(std::max(bufTriangles.size(), 2*MB));
-      bufLines.resize(std::max(bufLines.size(), 1*MB));
+      // let checkOverflow() see the number of cut elements, too
+      bufDispatch.bindTo(GL_COPY_READ_BUFFER);
+      bufCounters.bindTo(GL_COPY_WRITE_BUFFER);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                          offsetof(Dispatch, totalElems),
+                          bufCounters.offset() + offsetof(Counters, totalElems),
+                          sizeof(GLuint));
+   }
 
-      progMarch.use();
-      glUniform1i(progMarch.uniform("level"), level);
-      glUniform4fv(progMarch.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   bufVertices.bind(0);
+   bufTables.bind(1);
+   bufCutVertices.bind(2);
+   bufIndices.bind(3);
+   bufCounters.bind(4);
+   if (gpuCulling) {
+      bufCullIndices.bind(5); // not accessed
+   }
+   else {
+      bufSlots.bind(5);
+   }
+   bufLineIndices.bind(6);
+   bufEdgeMap.bind(7);
 
-      bufVertices.bind(0);
-      bufTables.bind(1);
-      bufTriangles.bind(2);
-      bufLines.bind(3);
+   if (gpuCulling) {
+      bufDispatch.bindTo(GL_DISPATCH_INDIRECT_BUFFER);
+   }
 
-      // reset the atomic counters
-      counters[0] = counters[1] = 0;
-      bufCounters.upload(counters, 2*sizeof(int));
-      bufCounters.bind(4);
+   // pass 1: generate the shared vertices on the intersected voxel edges
+   progEdges.use();
+   glUniform1i(progEdges.uniform("level"), level);
+   glUniform4fv(progEdges.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   glUniform1ui(progEdges.uniform("maxVertices"), maxVertices);
+   glUniform1i(progEdges.uniform("useSlots"), gpuCulling ? 0 : 1);
 
-      // launch the compute shader and wait for completion
+   if (gpuCulling) {
+      glDispatchComputeIndirect(offsetof(Dispatch, edgeGroups));
+   }
+   else {
+      glDispatchCompute(level+1, level+1, (level+1)*numElems);
+   }
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+   // pass 2: emit the triangles and lines as indices, don't wait
+   progMarch.use();
+   glUniform1i(progMarch.uniform("level"), level);
+   glUniform4fv(progMarch.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   glUniform1ui(progMarch.uniform("maxVertices"), maxVertices);
+   glUniform1ui(progMarch.uniform("maxIndices"), maxIndices);
+   glUniform1ui(progMarch.uniform("maxLineIndices"), maxLineIndices);
+   glUniform1i(progMarch.uniform("useSlots"), gpuCulling ? 0 : 1);
+
+   if (gpuCulling) {
+      glDispatchComputeIndirect(offsetof(Dispatch, marchGroups));
+   }
+   else {
       glDispatchCompute(level, level, level*numElems);
-      glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+   }
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+   // clamp the index counts to the buffer capacities
+   progFinalize.use();
+   glUniform1ui(progFinalize.uniform("maxIndices"), maxIndices);
+   glUniform1ui(progFinalize.uniform("maxLineIndices"), maxLineIndices);
+
+   bufCounters.bind(4);
+   glDispatchCompute(1, 1, 1);
+
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                   GL_ELEMENT_ARRAY_BARRIER_BIT |
+                   GL_COMMAND_BARRIER_BIT |
+                   GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+   bufCounters.fence();
+   if (!gpuCulling) {
+      bufSlots.fence(); // read by both passes above
+   }
 
-      // read the number of vertices generated
-      bufCounters.download(counters, 2*sizeof(int));
+   marchPending = true;
+}
 
-      long tsize = counters[0] * 4*sizeof(float);
-      long lsize = counters[1] * 4*sizeof(float);
 
-      if (tsize <= bufTriangles.size() &&
-          lsize <= bufLines.size())
-      {
-         // good, buffers were large enough, we're done
-         break;
-      }
+/// Double the size of 'buf' until it holds 'size' bytes. Return true if grown.
+static bool growBuffer(Buffer &buf, long size, const char *name)
+{
+   long newSize = std::max(buf.size(), 1L);
+   while (newSize < size) { newSize *= 2; }
 
-      // enlarge the buffers and try again
-      if (tsize > bufTriangles.size())
-      {
-         bufTriangles.resize(2*bufTriangles.size());
-         std::cout << "Triangle buffer size: "
-                   << double(bufTriangles.size())/MB << " MB." << std::endl;
-      }
-      if (lsize > bufLines.size())
-      {
-         bufLines.resize(2*bufLines.size());
-         std::cout << "Line buffer size: "
-                   << double(bufLines.size())/MB << " MB." << std::endl;
-      }
+   if (newSize > buf.size())
+   {
+      buf.resize(newSize);
+      std::cout << name << " buffer size: "
+                << double(buf.size())/MB << " MB." << std::endl;
+      return true;
    }
+   return false;
+}
+
+
+bool CutPlaneMesh::checkOverflow()
+{
+   // the totals are read only once the GPU is done, never stalling
+   if (!marchPending || !bufCounters.ready()) {
+      return false;
+   }
+   marchPending = false;
+
+   const Counters *cnt = (const Counters*) bufCounters.read(sizeof(Counters));
+
+   if (cnt->totalElems > maxElems)
+   {
+      // GPU culling found more elements than the voxel buffer can hold,
+      // enlarge it and compute everything again
+      long elemSize = 4*sizeof(float)*cube(subdivLevel+1);
+      growBuffer(bufVertices, elemSize*cnt->totalElems, "Voxel");
+
+      compute(clipPlane, *partMat, subdivLevel);
+      return true;
+   }
+
+   // enlarge the buffers if needed and redo the marching cubes (only)
+   bool grown = false;
+   grown |= growBuffer(bufCutVertices,
+                       4*sizeof(float)*long(cnt->totalVertices), "Cut vertex");
+   grown |= growBuffer(bufIndices,
+                       sizeof(GLuint)*long(cnt->totalIndices), "Index");
+   grown |= growBuffer(bufLineIndices,
+                       sizeof(GLuint)*long(cnt->totalLineIndices), "Line index");
+
+   if (grown) {
+      march();
+   }
+   return grown;
 }
 
 
 void CutPlaneMesh::draw(const glm::mat4 &mvp, bool lines)
 {
+   if (direct)
+   {
+      if (numElems && directLevel) {
+         drawDirect(mvp);
+      }
+      return;
+   }
+
+   if (!bufCounters.size()) {
+      return; // nothing computed
+   }
+
+   checkOverflow();
+
+   GPU_ZONE("draw cut plane");
+
    progDraw.use();
    glUniformMatrix4fv(progDraw.uniform("mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
    glUniform3fv(progDraw.uniform("palette"), RGB_Palette_3_Size,
                 (const float*) RGB_Palette_3);
 
-   bufTriangles.bind(0);
+   bufCutVertices.bind(0);
 
    glEnable(GL_POLYGON_OFFSET_FILL);
    glPolygonOffset(1, 1); // push triangles behind lines
 
+   // NOTE: the vertices are fetched from the SSBO by gl_VertexID, which is
+   // the index from the element array buffer
    glBindVertexArray(vao);
-   glDrawArrays(GL_TRIANGLES, 0, counters[0]);
+   bufIndices.bindTo(GL_ELEMENT_ARRAY_BUFFER);
+   bufCounters.bindTo(GL_DRAW_INDIRECT_BUFFER);
+   glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                          (const void*) (bufCounters.offset() +
+                                         offsetof(Counters, triCommand)));
 
    glDisable(GL_POLYGON_OFFSET_FILL);
    glPolygonOffset(0, 0);
@@ -224,20 +718,38 @@ void CutPlaneMesh::draw(const glm::mat4 &mvp, bool lines)
       progLines.use();
       glUniformMatrix4fv(progLines.uniform("mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
 
-      bufLines.bind(0);
+      bufCutVertices.bind(0);
 
       glBindVertexArray(vao);
-      glDrawArrays(GL_LINES, 0, counters[1]);
+      bufLineIndices.bindTo(GL_ELEMENT_ARRAY_BUFFER);
+      glDrawElementsIndirect(GL_LINES, GL_UNSIGNED_INT,
+                             (const void*) (bufCounters.offset() +
+                                            offsetof(Counters, lineCommand)));
    }
+
+   // the draw commands are read by the GPU, protect the ring segment
+   bufCounters.fence();
 }
 
 
 void CutPlaneMesh::free()
 {
    bufElemIndices.discard();
+   bufSlots.discard();
    bufVertices.discard();
+   voxelCache.reset(0, 0);
+   bufCullIndices.discard();
+   bufDirectIndices.discard();
+   bufDirectLines.discard();
+   directLevel = 0;
+   bufDispatch.discard();
+   bufBasis.discard();
+   basisLevel = 0;
    bufCounters.discard();
-   bufTriangles.discard();
-   bufLines.discard();
+   bufCutVertices.discard();
+   bufIndices.discard();
+   bufLineIndices.discard();
+   bufEdgeMap.discard();
+   marchPending = false;
    // NOTE: not discarding bufTables
 }
@@ -1,11 +1,13 @@
 #ifndef hogtess_cutmesh_hpp_included__
 #define hogtess_cutmesh_hpp_included__
 
-#include <glm/fwd.hpp>
+#include <glm/glm.hpp>
 
 #include "input/input.hpp"
 #include "shader.hpp"
 #include "buffer.hpp"
+#include "bvh.hpp"
+#include "slotcache.hpp"
 
 
 /**
@@ -15,7 +17,10 @@ class CutPlaneMesh
 public:
    CutPlaneMesh(const Solution &solution, const VolumeCoefs &coefs)
       : solution(solution), coefs(coefs)
-      , subdivLevel(0), vao(0)
+      , subdivLevel(0), numElems(0), marchPending(false)
+      , gpuCulling(false), direct(false), cpu(false), partMat(nullptr)
+      , voxelBudget(256*1024*1024), cacheLevel(0), directLevel(0)
+      , basisLevel(0), vao(0)
    {}
 
    /// Compile shaders.
@@ -27,9 +32,49 @@ public:
                 const Buffer &bufPartMat,
                 int level);
 
-   /// Draw the computed cut plane.
+   /** Draw the computed cut plane. The mesh is indexed, with each cut
+       vertex shared by all triangles around it. The index counts come
+       directly from the GPU (indirect draw), there is no CPU readback. */
    void draw(const glm::mat4 &mvp, bool lines);
 
+   /** Return true if the output buffer sizes of the last compute() haven't
+       been verified yet. The caller should draw again a little later (the
+       buffers are enlarged and the mesh recomputed in draw() if needed). */
+   bool pending() const { return marchPending; }
+
+   /** Verify the buffer sizes of a pending compute() if the GPU is done
+       (see pending()). Return true if the mesh was recomputed, i.e., needs
+       to be drawn again. Does not block. */
+   bool poll() { return checkOverflow(); }
+
+   /** Select the element culling method of compute(): on the CPU with the
+       BVH (default), or in a compute shader that compacts the cut elements
+       on the GPU and feeds indirect dispatches, without any host work. */
+   void setGpuCulling(bool gpu) { gpuCulling = gpu; }
+   bool getGpuCulling() const { return gpuCulling; }
+
+   /** Select the cut method of compute(): voxelization and marching cubes
+       (default), or a direct intersection, which evaluates the plane
+       distance at the element DOFs only, discards elements that don't
+       straddle the plane (Bernstein convex hull), and finds the cut on a
+       2D grid with a 1D root search per grid point. The direct cut always
+       uses CPU culling and doesn't draw mesh lines. */
+   void setDirect(bool d) { direct = d; }
+   bool getDirect() const { return direct; }
+
+   /** Voxelize the cut elements and run the marching cubes on the CPU
+       (CpuTesselator, cpuMarchingCubes) instead of in compute shaders, and
+       upload only the finished mesh. Always uses CPU culling. Meant as a
+       baseline for the GPU path, the times are printed. */
+   void setCpu(bool c) { cpu = c; }
+   bool getCpu() const { return cpu; }
+
+   /** Set the GPU memory budget for voxelized elements. With CPU culling,
+       the voxels of up to 'bytes' worth of elements are kept (LRU) and only
+       newly intersected elements are voxelized when the plane moves. The
+       budget is exceeded if a single cut needs more. */
+   void setVoxelBudget(long bytes) { voxelBudget = bytes; }
+
    /// Deallocate all GPU buffers.
    void free();
 
@@ -37,16 +82,65 @@ protected:
    const Solution &solution;
    const VolumeCoefs &coefs;
 
-   int subdivLevel, counters[2];
+   int subdivLevel, numElems;
+   glm::vec4 clipPlane;
+   bool marchPending;
+
+   bool gpuCulling, direct, cpu;
+   const Buffer *partMat;
+   GLuint maxElems;
 
-   Program progVoxelize, progMarch;
+   // voxel cache (CPU culling only): elements -> slots in bufVertices
+   long voxelBudget;
+   int cacheLevel;
+   std::vector<glm::mat4> cacheMatrices;
+   SlotCache voxelCache;
+   std::vector<int> cutElems, missElems;
+
+   // host copy of the coefficients for the CPU path
+   std::vector<float> hostCoefs;
+
+   Program progCull, progCullFinalize, progVoxelizeIndirect;
+   Program progVoxelize, progEdges, progMarch, progFinalize;
    Program progDraw, progLines;
+   Program progDirect, progDirectDraw;
+
+   RingBuffer bufElemIndices, bufSlots, bufCounters;
+   Buffer bufVertices, bufTables;
+   Buffer bufCutVertices, bufIndices, bufLineIndices, bufEdgeMap;
+   Buffer bufCullIndices, bufDispatch;
+   Buffer bufBasis;
+   int basisLevel;
+   Buffer bufDirectIndices, bufDirectLines;
+   int directLevel;
 
-   Buffer bufElemIndices, bufVertices;
-   Buffer bufTables, bufCounters;
-   Buffer bufTriangles, bufLines;
+   ElementBVH bvh;
 
    GLuint vao;
+
+   /// Contents of bufCounters.
+   struct Counters
+   {
+      GLuint triCommand[5], lineCommand[5]; // DrawElementsIndirectCommand
+      GLuint totalVertices, totalIndices, totalLineIndices;
+      GLuint totalElems; // copied from bufDispatch, for checkOverflow()
+   };
+
+   /// Contents of bufDispatch (GPU culling).
+   struct Dispatch
+   {
+      // DispatchIndirectCommand structures
+      GLuint voxelizeGroups[3], edgeGroups[3], marchGroups[3];
+      GLuint numElems, totalElems;
+   };
+
+   void cullGPU(int level);
+   void computeDirect(int level);
+   void computeCPU(int level);
+   void drawDirect(const glm::mat4 &mvp);
+   void updateVoxelCache(const Buffer &bufPartMat, int level);
+   void march();
+   bool checkOverflow();
 };
 
 
@@ -0,0 +1,226 @@
+#line 2
+
+// one work group per element
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer bufCoefs
+{
+   vec4 coefs[];
+};
+
+layout(std430, binding = 1) buffer bufElemIndices
+{
+   uint elemIndices[];
+};
+
+// two vec4 per vertex: (x, y, z, solution), (trim, 0, 0, 0)
+layout(std430, binding = 2) buffer bufVertices
+{
+   vec4 vertices[];
+};
+
+layout(std430, binding = 3) buffer bufRanks
+{
+   int elemRank[];
+};
+
+layout(std430, binding = 4) buffer bufPartMat
+{
+   mat4 matrices[];
+};
+
+// Lagrange basis at the tesselation points, basis[t*(P+1) + i]
+layout(std430, binding = 5) buffer bufBasis
+{
+   float basis[];
+};
+
+uniform vec4 clipPlane;
+uniform int level;
+
+// converts Lagrange nodal values to Bernstein coefficients (1D)
+uniform float lagrangeToBernstein[(P+1)*(P+1)];
+
+const int N1 = P+1;
+const int N3 = N1*N1*N1;
+
+shared float dist[N3], bern[N3];
+shared int axis;
+shared bool straddle;
+
+
+int dofIndex(int i, int j, int k) { return N1*(N1*i + j) + k; }
+
+const int axisStride[3] = { N1*N1, N1, 1 };
+
+
+// apply the 1D Lagrange to Bernstein conversion along one axis
+void convertAxis(in int ax, in bool toBern)
+{
+   for (uint n = gl_LocalInvocationID.x; n < N3; n += gl_WorkGroupSize.x)
+   {
+      int s = axisStride[ax];
+      int k = (int(n) / s) % N1;
+      int base = int(n) - k*s;
+
+      float sum = 0.0;
+      for (int i = 0; i < N1; i++)
+      {
+         float d = toBern ? dist[base + i*s] : bern[base + i*s];
+         sum += lagrangeToBernstein[k*N1 + i] * d;
+      }
+      if (toBern) { bern[n] = sum; } else { dist[n] = sum; }
+   }
+   barrier();
+}
+
+
+float evalPoly(in float g[N1], in float t)
+{
+   float shape[N1];
+   lagrangeShape(t, shape);
+
+   float f = 0.0;
+   for (int k = 0; k < N1; k++) {
+      f += g[k]*shape[k];
+   }
+   return f;
+}
+
+
+void main()
+{
+   uint elemIdx = gl_WorkGroupID.x;
+   uint elem = elemIndices[elemIdx];
+   uint coefBase = elem * N3;
+   mat4 mat = matrices[elemRank[elem]];
+
+   // the plane in the local space of the element's rank
+   vec4 plane = transpose(mat) * clipPlane;
+
+   // STEP 1: signed distance at the DOFs, convert to Bernstein form
+   for (uint n = gl_LocalInvocationID.x; n < N3; n += gl_WorkGroupSize.x)
+   {
+      dist[n] = dot(plane, vec4(coefs[coefBase + n].xyz, 1.0));
+   }
+   barrier();
+
+   convertAxis(0, true);
+   convertAxis(1, false);
+   convertAxis(2, true);
+
+   // STEP 2: convex hull test, choose the axis along which the distance
+   // changes the most (the cut is a graph over the other two axes)
+   if (gl_LocalInvocationID.x == 0)
+   {
+      float bmin = bern[0], bmax = bern[0];
+      for (int n = 1; n < N3; n++)
+      {
+         bmin = min(bmin, bern[n]);
+         bmax = max(bmax, bern[n]);
+      }
+      straddle = (bmin <= 0.0 && bmax >= 0.0);
+
+      vec3 change = vec3(0.0);
+      for (int i = 0; i < N1; i++)
+      for (int j = 0; j < N1; j++)
+      {
+         change.x += bern[dofIndex(P, i, j)] - bern[dofIndex(0, i, j)];
+         change.y += bern[dofIndex(i, P, j)] - bern[dofIndex(i, 0, j)];
+         change.z += bern[dofIndex(i, j, P)] - bern[dofIndex(i, j, 0)];
+      }
+      change = abs(change);
+      axis = (change.x >= change.y && change.x >= change.z) ? 0
+           : (change.y >= change.z) ? 1 : 2;
+   }
+   barrier();
+
+   // STEP 3: for each point of a 2D grid, find the root along 'axis'
+   int ax = axis;
+   int axA = (ax == 0) ? 1 : 0;
+   int axB = (ax == 2) ? 1 : 2;
+
+   uint nv = (level+1)*(level+1);
+   uint vertBase = 2*elemIdx*nv;
+
+   for (uint n = gl_LocalInvocationID.x; n < nv; n += gl_WorkGroupSize.x)
+   {
+      if (!straddle)
+      {
+         // no intersection, clip away all triangles of the element
+         vertices[vertBase + 2*n + 1] = vec4(-1.0, 0, 0, 0);
+         continue;
+      }
+
+      // the grid points are tesselation points, use the basis table
+      uint ta = n % (level+1), tb = n / (level+1);
+      float ashape[N1], bshape[N1];
+      for (int i = 0; i < N1; i++)
+      {
+         ashape[i] = basis[ta*N1 + i];
+         bshape[i] = basis[tb*N1 + i];
+      }
+
+      // reduce the element to a 1D polynomial along 'axis'
+      vec4 G[N1];
+      float g[N1];
+      for (int k = 0; k < N1; k++)
+      {
+         G[k] = vec4(0.0);
+         for (int i = 0; i < N1; i++)
+         for (int j = 0; j < N1; j++)
+         {
+            int dof = k*axisStride[ax] + i*axisStride[axA] + j*axisStride[axB];
+            G[k] += coefs[coefBase + dof] * ashape[i] * bshape[j];
+         }
+         g[k] = dot(plane, vec4(G[k].xyz, 1.0));
+      }
+
+      // bracket the root, refine with regula falsi (Illinois)
+      float t0 = 0.0, t1 = 1.0;
+      float f0 = evalPoly(g, t0), f1 = evalPoly(g, t1);
+      float t = (f1 != f0) ? f0 / (f0 - f1) : -1.0;
+
+      if (f0*f1 < 0.0)
+      {
+         int side = 0;
+         for (int it = 0; it < 30; it++)
+         {
+            t = (t0*f1 - t1*f0) / (f1 - f0);
+            float f = evalPoly(g, t);
+            if (abs(f) < 1e-7) { break; }
+
+            if (f*f1 > 0.0)
+            {
+               t1 = t; f1 = f;
+               if (side == -1) { f0 *= 0.5; }
+               side = -1;
+            }
+            else
+            {
+               t0 = t; f0 = f;
+               if (side == +1) { f1 *= 0.5; }
+               side = +1;
+            }
+         }
+      }
+      // else: no root inside, 't' is the linear extrapolation
+
+      // trim > 0 inside the element, interpolated by the clipper
+      float trim = min(t, 1.0 - t);
+
+      float shape[N1];
+      lagrangeShape(clamp(t, 0.0, 1.0), shape);
+
+      vec4 value = vec4(0.0);
+      for (int k = 0; k < N1; k++) {
+         value += G[k]*shape[k];
+      }
+      value.xyz = (mat * vec4(value.xyz, 1.0)).xyz;
+
+      vertices[vertBase + 2*n] = value;
+      vertices[vertBase + 2*n + 1] = vec4(trim, 0, 0, 0);
+   }
+}
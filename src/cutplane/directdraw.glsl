@@ -0,0 +1,44 @@
+#line 2
+#if _VERTEX_
+
+out float solution;
+out float gl_ClipDistance[1];
+
+uniform mat4 mvp;
+uniform int nElemVert;
+
+layout(std430, binding = 0) buffer bufVertices
+{
+   vec4 vertices[];
+};
+
+layout(std430, binding = 1) buffer bufIndices
+{
+   int indices[];
+};
+
+void main()
+{
+   int index = 2*(indices[gl_VertexID] + gl_InstanceID*nElemVert);
+   vec4 vert = vertices[index];
+   gl_Position = mvp * vec4(vert.xyz, 1);
+   solution = vert.w;
+
+   // trim the parts of the grid that fall outside of the element
+   gl_ClipDistance[0] = vertices[index + 1].x;
+}
+
+#elif _FRAGMENT_
+
+in float solution;
+out vec4 fragColor;
+
+uniform vec3 palette[PALETTE_SIZE];
+
+void main()
+{
+    int i = clamp(int(solution * PALETTE_SIZE), 0, PALETTE_SIZE-1);
+    fragColor = vec4(palette[i], 1);
+}
+
+#endif
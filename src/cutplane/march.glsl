@@ -16,23 +16,61 @@ layout(std430, binding = 1) buffer bufTables
    int triTable[256][16];
 };
 
-layout(std430, binding = 2) buffer bufTriangles
+// shared vertices of the cut, one per intersected voxel edge
+layout(std430, binding = 2) buffer bufCutVertices
 {
    vec4 outVertices[];
 };
 
-layout(std430, binding = 3) buffer bufLines
+layout(std430, binding = 3) buffer bufIndices
 {
-   vec4 outLines[];
+   uint outIndices[];
 };
 
+// two DrawElementsIndirectCommand structures followed by the raw totals
 layout(std430, binding = 4) buffer bufCounters
 {
-   uint totalVertices, totalLines;
+   uint triCount, triInstances, triFirst, triBaseVertex, triBaseInstance;
+   uint lineCount, lineInstances, lineFirst, lineBaseVertex, lineBaseInstance;
+   uint totalVertices, totalIndices, totalLineIndices;
+};
+
+// slots of the elements in bufVertices (voxel cache), if useSlots != 0
+layout(std430, binding = 5) buffer bufSlots
+{
+   uint elemSlots[];
+};
+
+layout(std430, binding = 6) buffer bufLineIndices
+{
+   uint outLineIndices[];
+};
+
+// index of the cut vertex of each intersected voxel edge: the edge from
+// grid vertex 'v' in direction 'dir' has the entry 3*v + dir
+layout(std430, binding = 7) buffer bufEdgeMap
+{
+   uint edgeMap[];
 };
 
 uniform vec4 clipPlane;
 uniform int level;
+uniform int useSlots;
+
+// capacity of the output buffers (indices: multiples of 3 and 2)
+uniform uint maxVertices, maxIndices, maxLineIndices;
+
+
+#if PASS == 2
+
+// clamp the draw commands to what actually fit in the buffers
+void main()
+{
+   triCount = min(totalIndices, maxIndices);
+   lineCount = min(totalLineIndices, maxLineIndices);
+}
+
+#else
 
 const uvec3 cornerXYZ[8] =
 {
@@ -57,24 +95,90 @@ float planeDistance(vec4 pt)
 }
 
 
+// bits set for the 6 boundary planes of the element that 'v' touches
+uint boundaryMask(uvec3 v)
+{
+   uvec3 lo = uvec3(0, 0, 0);
+   uvec3 hi = uvec3(level, level, level);
+   return uint(dot(uvec3(equal(v, lo)), uvec3(1, 2, 4))) +
+          uint(dot(uvec3(equal(v, hi)), uvec3(8, 16, 32)));
+}
+
+uint gridIndex(uvec3 v)
+{
+   uint level1 = level+1;
+   return level1*(level1*v.z + v.y) + v.x;
+}
+
+vec4 gridVertex(uint slot, uvec3 v)
+{
+   uint level1 = level+1;
+   return vertices[slot*level1*level1*level1 + gridIndex(v)];
+}
+
+
+#if PASS == 0
+
+// edge pass: each grid vertex owns the three edges in the +x, +y, +z
+// directions and generates the cut vertices on those that are intersected
+void main()
+{
+   uint level1 = level+1;
+   uint elemVerts = level1*level1*level1;
+   uint elemIdx = gl_GlobalInvocationID.z / level1;
+   uint slot = (useSlots != 0) ? elemSlots[elemIdx] : elemIdx;
+   uvec3 v = uvec3(gl_GlobalInvocationID.xy,
+                   gl_GlobalInvocationID.z % level1);
+
+   vec4 p0 = gridVertex(slot, v);
+   float d0 = planeDistance(p0);
+
+   for (uint dir = 0; dir < 3; dir++)
+   {
+      if (v[dir] >= level) { continue; }
+
+      uvec3 w = v;
+      w[dir]++;
+
+      vec4 p1 = gridVertex(slot, w);
+      float d1 = planeDistance(p1);
+
+      // NOTE: same sign test as the cube index in the cell pass
+      if ((d0 < 0) != (d1 < 0))
+      {
+         uint pos = atomicAdd(totalVertices, 1);
+         if (pos < maxVertices) {
+            outVertices[pos] = interpolate(p0, p1, d0, d1);
+         }
+         edgeMap[3*(elemIdx*elemVerts + gridIndex(v)) + dir] = pos;
+      }
+   }
+}
+
+#else // PASS == 1
+
+// MC edge -> (cube corner where the edge starts, direction)
+const uint edgeOrigin[12] = { 0, 1, 3, 0, 4, 5, 7, 4, 0, 1, 2, 3 };
+const uint edgeDir[12] = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+
+// cell pass: emit triangles (and boundary lines) as indices of the vertices
+// generated by the edge pass
 void main()
 {
-   vec4 corner[8];
    float dist[8];
-   vec4 vertex[12];
+   uint vertex[12];
 
    int level1 = level+1;
    uint elemVerts = level1*level1*level1;
    uint elemIdx = gl_GlobalInvocationID.z / level;
+   uint slot = (useSlots != 0) ? elemSlots[elemIdx] : elemIdx;
    uvec3 xyz = uvec3(gl_GlobalInvocationID.xy,
                      gl_GlobalInvocationID.z % level);
 
    uint cubeIndex = 0;
    for (uint i = 0, bit = 1; i < 8; i++, bit *= 2)
    {
-      uvec3 v = (xyz + cornerXYZ[i]);
-      corner[i] = vertices[elemIdx*elemVerts + level1*(level1*v.z + v.y) + v.x];
-      dist[i] = planeDistance(corner[i]);
+      dist[i] = planeDistance(gridVertex(slot, xyz + cornerXYZ[i]));
 
       if (dist[i] < 0) {
          cubeIndex |= bit;
@@ -87,83 +191,47 @@ void main()
       return;
    }
 
-   // for each vertex, check if it touches the 6 boundary planes of the element
-   uint vmask[8], emask[12];
-   uvec3 lo = uvec3(0, 0, 0);
-   uvec3 hi = uvec3(level, level, level);
-
-   for (uint i = 0; i < 8; i++)
+   // look up the shared vertices on the intersected edges, for each edge
+   // also check if it lies on one of the 6 boundary planes of the element
+   uint emask[12];
+   bool valid = true;
+   for (uint e = 0; e < 12; e++)
    {
-      uvec3 v = (xyz + cornerXYZ[i]);
-      vmask[i] = uint(dot(uvec3(equal(v, lo)), uvec3(1, 2, 4))) +
-                 uint(dot(uvec3(equal(v, hi)), uvec3(8, 16, 32)));
-   }
+      if ((edgeMask & (1 << e)) != 0)
+      {
+         uint o = edgeOrigin[e], dir = edgeDir[e];
+         uvec3 v = xyz + cornerXYZ[o];
 
-   // interpolate isosurface vertices along cube edges
-   if ((edgeMask & 1) != 0) {
-      vertex[0] = interpolate(corner[0], corner[1], dist[0], dist[1]);
-      emask[0] = vmask[0] & vmask[1];
-   }
-   if ((edgeMask & 2) != 0) {
-      vertex[1] = interpolate(corner[1], corner[2], dist[1], dist[2]);
-      emask[1] = vmask[1] & vmask[2];
-   }
-   if ((edgeMask & 4) != 0) {
-      vertex[2] = interpolate(corner[2], corner[3], dist[2], dist[3]);
-      emask[2] = vmask[2] & vmask[3];
-   }
-   if ((edgeMask & 8) != 0) {
-      vertex[3] = interpolate(corner[3], corner[0], dist[3], dist[0]);
-      emask[3] = vmask[3] & vmask[0];
-   }
-   if ((edgeMask & 16) != 0) {
-      vertex[4] = interpolate(corner[4], corner[5], dist[4], dist[5]);
-      emask[4] = vmask[4] & vmask[5];
-   }
-   if ((edgeMask & 32) != 0) {
-      vertex[5] = interpolate(corner[5], corner[6], dist[5], dist[6]);
-      emask[5] = vmask[5] & vmask[6];
-   }
-   if ((edgeMask & 64) != 0) {
-      vertex[6] = interpolate(corner[6], corner[7], dist[6], dist[7]);
-      emask[6] = vmask[6] & vmask[7];
-   }
-   if ((edgeMask & 128) != 0) {
-      vertex[7] = interpolate(corner[7], corner[4], dist[7], dist[4]);
-      emask[7] = vmask[7] & vmask[4];
-   }
-   if ((edgeMask & 256) != 0) {
-      vertex[8] = interpolate(corner[0], corner[4], dist[0], dist[4]);
-      emask[8] = vmask[0] & vmask[4];
-   }
-   if ((edgeMask & 512) != 0) {
-      vertex[9] = interpolate(corner[1], corner[5], dist[1], dist[5]);
-      emask[9] = vmask[1] & vmask[5];
-   }
-   if ((edgeMask & 1024) != 0) {
-      vertex[10] = interpolate(corner[2], corner[6], dist[2], dist[6]);
-      emask[10] = vmask[2] & vmask[6];
-   }
-   if ((edgeMask & 2048) != 0) {
-      vertex[11] = interpolate(corner[3], corner[7], dist[3], dist[7]);
-      emask[11] = vmask[3] & vmask[7];
+         vertex[e] = edgeMap[3*(elemIdx*elemVerts + gridIndex(v)) + dir];
+         valid = valid && (vertex[e] < maxVertices);
+
+         uvec3 w = v;
+         w[dir]++;
+         emask[e] = boundaryMask(v) & boundaryMask(w);
+      }
    }
 
    uint nv = triTable[cubeIndex][15];
-   uint pos = atomicAdd(totalVertices, nv);
+   uint pos = atomicAdd(totalIndices, nv);
 
    uint nl = 0;
-   vec4 tmpLines[12];
+   uint tmpLines[12];
 
-   for (uint i = 0; i < nv; )
+   // NOTE: on overflow, only whole triangles that fit are stored, so that
+   // the clamped count in the draw command never includes garbage; if
+   // some vertices didn't fit, degenerate triangles are stored instead
+   for (uint i = 0; i < nv; pos += 3)
    {
       int a = triTable[cubeIndex][i++];
       int b = triTable[cubeIndex][i++];
       int c = triTable[cubeIndex][i++];
 
-      outVertices[pos++] = vertex[a];
-      outVertices[pos++] = vertex[b];
-      outVertices[pos++] = vertex[c];
+      if (pos + 3 <= maxIndices)
+      {
+         outIndices[pos] = valid ? vertex[a] : 0;
+         outIndices[pos+1] = valid ? vertex[b] : 0;
+         outIndices[pos+2] = valid ? vertex[c] : 0;
+      }
 
       if ((emask[a] & emask[b]) != 0) {
          tmpLines[nl++] = vertex[a];
@@ -181,10 +249,19 @@ void main()
 
    if (nl != 0)
    {
-      pos = atomicAdd(totalLines, nl);
+      pos = atomicAdd(totalLineIndices, nl);
 
-      for (uint i = 0; i < nl; i++) {
-         outLines[pos++] = tmpLines[i];
+      for (uint i = 0; i < nl; i += 2, pos += 2)
+      {
+         if (pos + 2 <= maxLineIndices)
+         {
+            outLineIndices[pos] = valid ? tmpLines[i] : 0;
+            outLineIndices[pos+1] = valid ? tmpLines[i+1] : 0;
+         }
       }
    }
 }
+
+#endif // PASS == 1
+
+#endif // PASS == 2
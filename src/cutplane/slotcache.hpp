@@ -0,0 +1,64 @@
+#ifndef hogtess_slotcache_hpp_included__
+#define hogtess_slotcache_hpp_included__
+
+#include <vector>
+#include <list>
+
+
+/** Assigns cache slots to integer keys (0 <= key < numKeys) and evicts the
+ *  least recently used key when all slots are taken. Only the bookkeeping
+ *  is done here, the slots themselves live elsewhere (e.g., in a GPU buffer).
+ */
+class SlotCache
+{
+public:
+   SlotCache() {}
+
+   /// Invalidate everything, set the number of keys and slots.
+   void reset(int numKeys, int numSlots)
+   {
+      keySlot.assign(numKeys, -1);
+      slotKey.assign(numSlots, -1);
+      lru.clear();
+      lruPos.resize(numSlots);
+      for (int i = 0; i < numSlots; i++) {
+         lruPos[i] = lru.insert(lru.end(), i);
+      }
+   }
+
+   int numKeys() const { return keySlot.size(); }
+   int numSlots() const { return slotKey.size(); }
+
+   /** Return the slot of 'key' and mark it as most recently used, or
+       return -1 if the key is not cached. */
+   int find(int key)
+   {
+      int slot = keySlot[key];
+      if (slot >= 0) {
+         lru.splice(lru.begin(), lru, lruPos[slot]);
+      }
+      return slot;
+   }
+
+   /** Assign a slot to 'key' (not cached), evicting the least recently used
+       key if necessary. The slot becomes the most recently used one. */
+   int insert(int key)
+   {
+      int slot = lru.back();
+      if (slotKey[slot] >= 0) {
+         keySlot[slotKey[slot]] = -1;
+      }
+      slotKey[slot] = key;
+      keySlot[key] = slot;
+      lru.splice(lru.begin(), lru, lruPos[slot]);
+      return slot;
+   }
+
+protected:
+   std::vector<int> keySlot, slotKey;
+   std::list<int> lru; // slots, most recently used first
+   std::vector<std::list<int>::iterator> lruPos;
+};
+
+
+#endif // hogtess_slotcache_hpp_included__
@@ -1,6 +1,7 @@
 #line 2
 
-layout(local_size_x = 32,
+// one work group per element
+layout(local_size_x = 64,
        local_size_y = 1,
        local_size_z = 1) in;
 
@@ -30,44 +31,117 @@ layout(std430, binding = 4) buffer bufPartMat
 };
 
 
-uniform int level;
-uniform float invLevel;
+#if INDIRECT
+// element count written by cull.glsl
+layout(std430, binding = 5) buffer bufDispatch
+{
+   uint voxelizeGroups[3], edgeGroups[3], marchGroups[3];
+   uint numElems, totalElems;
+};
+#else
 uniform int numElems;
+#endif
 
-void main()
+// Lagrange basis at the tesselation points, basis[t*(P+1) + i]
+layout(std430, binding = 6) buffer bufBasis
 {
-   const int ndof = (P+1)*(P+1)*(P+1);
-   const int elemVert = (level+1)*(level+1)*(level+1);
+   float basis[];
+};
+
+uniform int level;
+
+const int N1 = P+1;
+const int ndof = N1*N1*N1;
 
-   uint tessX = gl_GlobalInvocationID.x % (level+1);
-   uint tessY = gl_GlobalInvocationID.y;
-   uint tessZ = gl_GlobalInvocationID.z;
-   uint elemIdx = gl_GlobalInvocationID.x / (level+1);
+// shape functions at the tesselation points, shape[t*N1 + i]
+shared float shape[(MAX_LEVEL+1)*N1];
 
-   if (elemIdx >= numElems) { return; }
+#if STAGE_COEFS
+shared vec4 elemCoefs[ndof];
+#define COEF(n) elemCoefs[n]
+#else
+// the element does not fit in shared memory (high P), read it directly
+#define COEF(n) coefs[coefBase + (n)]
+#endif
+shared vec4 slabA[N1*N1];
+shared vec4 slabB[N1*(MAX_LEVEL+1)];
 
-   uint coefBase = elemIndices[elemIdx] * ndof;
+// Sum-factorized evaluation: the element is processed in Z slabs, for each
+// slab the coefficients are contracted one dimension at a time (Z, Y, X).
+void main()
+{
+   uint level1 = level+1;
+   uint elemVert = level1*level1*level1;
 
-   float u = tessX * invLevel;
-   float v = tessY * invLevel;
-   float w = tessZ * invLevel;
+   uint elemIdx = gl_WorkGroupID.x;
+   if (elemIdx >= numElems) { return; } // whole group
 
-   float ushape[P+1], vshape[P+1], wshape[P+1];
-   lagrangeShape(u, ushape);
-   lagrangeShape(v, vshape);
-   lagrangeShape(w, wshape);
+   uint elem = elemIndices[elemIdx];
+   uint coefBase = elem * ndof;
+   mat4 mat = matrices[elemRank[elem]];
 
-   vec4 value = vec4(0.0);
-   for (int i = 0; i <= P; i++)
-   for (int j = 0; j <= P; j++)
-   for (int k = 0; k <= P; k++)
+#if INDIRECT
+   uint slot = elemIdx;
+#else
+   // slots in the voxel cache follow the element indices
+   uint slot = elemIndices[numElems + elemIdx];
+#endif
+
+   for (uint n = gl_LocalInvocationID.x; n < level1*N1; n += gl_WorkGroupSize.x)
    {
-       vec4 coef = coefs[coefBase + (P+1)*((P+1)*i + j) + k];
-       value += coef*ushape[i]*vshape[j]*wshape[k];
+      shape[n] = basis[n];
    }
+#if STAGE_COEFS
+   for (uint n = gl_LocalInvocationID.x; n < ndof; n += gl_WorkGroupSize.x)
+   {
+      elemCoefs[n] = coefs[coefBase + n];
+   }
+#endif
+   barrier();
 
-   vec4 pos = matrices[elemRank[elemIndices[elemIdx]]] * vec4(value.xyz, 1);
-   value.xyz = pos.xyz;
-
-   vertices[elemIdx*elemVert + (level+1)*((level+1)*tessZ + tessY) + tessX] = value;
+   for (uint tz = 0; tz < level1; tz++)
+   {
+      // contract Z: A[i][j] = sum_k C[i][j][k] * shape_k(z)
+      for (uint n = gl_LocalInvocationID.x; n < N1*N1; n += gl_WorkGroupSize.x)
+      {
+         vec4 sum = vec4(0.0);
+         for (int k = 0; k < N1; k++) {
+            sum += COEF(n*N1 + k) * shape[tz*N1 + k];
+         }
+         slabA[n] = sum;
+      }
+      barrier();
+
+      // contract Y: B[i][ty] = sum_j A[i][j] * shape_j(y)
+      for (uint n = gl_LocalInvocationID.x; n < N1*level1;
+           n += gl_WorkGroupSize.x)
+      {
+         uint i = n / level1, ty = n % level1;
+
+         vec4 sum = vec4(0.0);
+         for (int j = 0; j < N1; j++) {
+            sum += slabA[i*N1 + j] * shape[ty*N1 + j];
+         }
+         slabB[n] = sum;
+      }
+      barrier();
+
+      // contract X and store the vertices of the slab
+      for (uint n = gl_LocalInvocationID.x; n < level1*level1;
+           n += gl_WorkGroupSize.x)
+      {
+         uint tx = n % level1, ty = n / level1;
+
+         vec4 value = vec4(0.0);
+         for (int i = 0; i < N1; i++) {
+            value += slabB[i*level1 + ty] * shape[tx*N1 + i];
+         }
+
+         vec4 pos = mat * vec4(value.xyz, 1);
+         value.xyz = pos.xyz;
+
+         vertices[slot*elemVert + level1*(level1*tz + ty) + tx] = value;
+      }
+      // NOTE: no barrier needed here, slabB is next written after a barrier
+   }
 }
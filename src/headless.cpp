@@ -0,0 +1,364 @@
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef HOGTESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+
+#include "headless.hpp"
+#include "view.hpp"
+#include "profiler.hpp"
+#include "utility.hpp"
+#include "shape/shape.hpp"
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+
+void FrameParams::validate() const
+{
+   if (tessLevel < 1 || tessLevel > MaxTessLevel)
+   {
+      throw std::runtime_error(format_str(
+         "Invalid tesselation level %d (must be 1 to %d).",
+         tessLevel, MaxTessLevel));
+   }
+   if (clipMode < 0 || clipMode > 3)
+   {
+      throw std::runtime_error(format_str(
+         "Invalid clip mode %d (must be 0 to 3).", clipMode));
+   }
+}
+
+
+HeadlessRenderer::HeadlessRenderer(const Solution &solution,
+                                   SurfaceCoefs &surfaceCoefs,
+                                   VolumeCoefs &volumeCoefs,
+                                   int width, int height, int samples)
+   : solution(solution)
+   , surfaceCoefs(surfaceCoefs)
+   , volumeCoefs(volumeCoefs)
+   , width(width), height(height)
+   , fbo(0), colorRb(0), depthRb(0), resolveFbo(0), resolveRb(0)
+   , pbo{0, 0}, fence{0, 0}
+   , stride(roundUpMultiple(3*width, 4))
+   , surfaceMesh(solution, surfaceCoefs)
+   , cutPlaneMesh(solution, volumeCoefs)
+   , meshLevel(-1), cutLevel(-1), cutMode(-1), partExplode(-1)
+   , cutX(0), cutY(0), cutZ(0)
+{
+   createContext();
+   initializeRenderState();
+
+   createFramebuffer(samples);
+
+   surfaceMesh.initializeGL(solution.order());
+   cutPlaneMesh.initializeGL(solution.order());
+}
+
+
+HeadlessRenderer::~HeadlessRenderer()
+{
+#ifdef HOGTESS_EGL
+   if (egl.context)
+   {
+      // the meshes free their GL objects later, keep the context current
+      glDeleteFramebuffers(1, &fbo);
+      glDeleteFramebuffers(1, &resolveFbo);
+      glDeleteRenderbuffers(1, &colorRb);
+      glDeleteRenderbuffers(1, &depthRb);
+      glDeleteRenderbuffers(1, &resolveRb);
+      glDeleteBuffers(2, pbo);
+      for (int i = 0; i < 2; i++)
+      {
+         if (fence[i]) { glDeleteSync(fence[i]); }
+      }
+   }
+#endif
+}
+
+
+HeadlessRenderer::EglContext::~EglContext()
+{
+#ifdef HOGTESS_EGL
+   if (context)
+   {
+      eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+      eglDestroyContext(display, context);
+   }
+   if (display) {
+      eglTerminate(display);
+   }
+#endif
+}
+
+
+void HeadlessRenderer::createContext()
+{
+#ifdef HOGTESS_EGL
+   EGLDisplay dpy = EGL_NO_DISPLAY;
+
+   // prefer the surfaceless platform, no window system is needed at all
+   auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+      eglGetProcAddress("eglGetPlatformDisplayEXT");
+   if (getPlatformDisplay)
+   {
+      dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                               EGL_DEFAULT_DISPLAY, NULL);
+   }
+   if (dpy == EGL_NO_DISPLAY) {
+      dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+   }
+
+   EGLint major, minor;
+   if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)) {
+      throw std::runtime_error("Cannot initialize an EGL display.");
+   }
+   egl.display = dpy; // terminated by ~EglContext, also if we throw below
+   if (!eglBindAPI(EGL_OPENGL_API)) {
+      throw std::runtime_error("EGL does not support desktop OpenGL.");
+   }
+
+   const EGLint configAttribs[] = {
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_NONE
+   };
+   EGLConfig config;
+   EGLint numConfigs = 0;
+   if (!eglChooseConfig(dpy, configAttribs, &config, 1, &numConfigs) ||
+       !numConfigs)
+   {
+      throw std::runtime_error("No suitable EGL configuration.");
+   }
+
+   // compatibility profile like the Qt window, some drivers only offer core
+   EGLContext ctx = EGL_NO_CONTEXT;
+   const EGLint profiles[2] = {
+      EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+      EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT
+   };
+   for (int i = 0; i < 2 && ctx == EGL_NO_CONTEXT; i++)
+   {
+      const EGLint contextAttribs[] = {
+         EGL_CONTEXT_MAJOR_VERSION, 4,
+         EGL_CONTEXT_MINOR_VERSION, 3,
+         EGL_CONTEXT_OPENGL_PROFILE_MASK, profiles[i],
+         EGL_NONE
+      };
+      ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+   }
+   if (ctx == EGL_NO_CONTEXT) {
+      throw std::runtime_error("Cannot create an OpenGL 4.3 EGL context.");
+   }
+   egl.context = ctx;
+
+   // no surface, everything goes to our framebuffer object
+   if (!eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx)) {
+      throw std::runtime_error("Cannot make the EGL context current "
+                               "(EGL_KHR_surfaceless_context missing?).");
+   }
+
+   std::cout << "EGL " << major << "." << minor << ", "
+             << eglQueryString(dpy, EGL_VENDOR) << std::endl;
+#else
+   throw std::runtime_error("hogtess was built without EGL, "
+                            "headless rendering is not available.");
+#endif
+}
+
+
+void HeadlessRenderer::createFramebuffer(int samples)
+{
+   GLint maxSamples;
+   glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+   samples = std::min(samples, int(maxSamples));
+
+   glGenRenderbuffers(1, &colorRb);
+   glBindRenderbuffer(GL_RENDERBUFFER, colorRb);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8,
+                                    width, height);
+
+   glGenRenderbuffers(1, &depthRb);
+   glBindRenderbuffer(GL_RENDERBUFFER, depthRb);
+   glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
+                                    GL_DEPTH_COMPONENT24, width, height);
+
+   glGenFramebuffers(1, &fbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                             GL_RENDERBUFFER, colorRb);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                             GL_RENDERBUFFER, depthRb);
+
+   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      throw std::runtime_error("Cannot create the offscreen framebuffer.");
+   }
+
+   // single sampled copy for glReadPixels
+   glGenRenderbuffers(1, &resolveRb);
+   glBindRenderbuffer(GL_RENDERBUFFER, resolveRb);
+   glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+   glGenFramebuffers(1, &resolveFbo);
+   glBindFramebuffer(GL_FRAMEBUFFER, resolveFbo);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                             GL_RENDERBUFFER, resolveRb);
+
+   // two pixel pack buffers to overlap readback with the next frame
+   glGenBuffers(2, pbo);
+   for (int i = 0; i < 2; i++)
+   {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, stride*height, NULL, GL_STREAM_READ);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+   glViewport(0, 0, width, height);
+}
+
+
+void HeadlessRenderer::render(const FrameParams &params)
+{
+   PROFILE_ZONE("render frame");
+
+   params.validate();
+
+   if (params.explode != partExplode)
+   {
+      std::vector<glm::mat4> matrices = partMatrices(solution, params.explode);
+      bufPartMat.upload(matrices);
+      bufPartMat.copy(matrices);
+
+      partExplode = params.explode;
+      cutLevel = -1; // the cut depends on the part matrices, too
+   }
+
+   if (params.tessLevel != meshLevel)
+   {
+      if (!surfaceCoefs.numFaces()) {
+         surfaceCoefs.extract(solution);
+      }
+      surfaceMesh.tesselate(params.tessLevel);
+      meshLevel = params.tessLevel;
+   }
+
+   glm::vec4 clipPlane = clipPlaneEquation(params.clipX, params.clipY,
+                                           params.clipZ);
+   if (params.clipMode != 0 &&
+       (params.clipMode != cutMode || params.tessLevel != cutLevel ||
+        params.clipX != cutX || params.clipY != cutY || params.clipZ != cutZ))
+   {
+      if (!volumeCoefs.numElements()) {
+         volumeCoefs.extract(solution);
+      }
+      cutPlaneMesh.setDirect(params.clipMode == 2);
+      cutPlaneMesh.setCpu(params.clipMode == 3);
+      cutPlaneMesh.compute(clipPlane, bufPartMat, params.tessLevel);
+
+      // there is no next frame to wait for, verify the buffers now
+      while (cutPlaneMesh.pending())
+      {
+         glFinish();
+         cutPlaneMesh.poll();
+      }
+
+      cutMode = params.clipMode;
+      cutLevel = params.tessLevel;
+      cutX = params.clipX, cutY = params.clipY, cutZ = params.clipZ;
+   }
+
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+   glViewport(0, 0, width, height);
+
+   glClearColor(1, 1, 1, 1);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+   glm::mat4 mvp = viewMatrix(double(width) / height, params.rotateX,
+                              params.rotateY, params.zoom);
+
+   // draw tesselated surface
+   if (params.clipMode != 0) {
+      glEnable(GL_CLIP_DISTANCE0);
+   }
+   else {
+      glDisable(GL_CLIP_DISTANCE0);
+   }
+   surfaceMesh.draw(mvp, clipPlane, bufPartMat, params.lines);
+
+   // draw cut plane
+   glDisable(GL_CLIP_DISTANCE0);
+   if (params.clipMode != 0) {
+      cutPlaneMesh.draw(mvp, params.lines);
+   }
+}
+
+
+void HeadlessRenderer::readback(int slot)
+{
+   // resolve the samples
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFbo);
+   glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                     GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+   // with a PBO bound, glReadPixels returns immediately
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, resolveFbo);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+   if (fence[slot]) {
+      glDeleteSync(fence[slot]);
+   }
+   fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+
+QImage HeadlessRenderer::image(int slot)
+{
+   if (fence[slot])
+   {
+      glClientWaitSync(fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                       GL_TIMEOUT_IGNORED);
+      glDeleteSync(fence[slot]);
+      fence[slot] = 0;
+   }
+
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+   const unsigned char* pixels = (const unsigned char*)
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, stride*height,
+                       GL_MAP_READ_BIT);
+   if (!pixels)
+   {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      throw std::runtime_error("Cannot map the readback buffer.");
+   }
+
+   // GL rows go bottom up, mirrored() also makes a deep copy
+   QImage image = QImage(pixels, width, height, stride,
+                         QImage::Format_RGB888).mirrored();
+
+   glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   return image;
+}
+
+
+void HeadlessRenderer::save(const std::string &path)
+{
+   readback(0);
+   if (!image(0).save(QString::fromStdString(path)))
+   {
+      throw std::runtime_error("Cannot write image " + path);
+   }
+   std::cout << "Wrote " << path << std::endl;
+}
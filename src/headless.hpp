@@ -0,0 +1,116 @@
+#ifndef hogtess_headless_hpp_included__
+#define hogtess_headless_hpp_included__
+
+#include <string>
+#include <vector>
+
+#include <QImage>
+
+#include "input/input.hpp"
+#include "surface/surface.hpp"
+#include "cutplane/cutmesh.hpp"
+
+
+/// Parameters of one image rendered by HeadlessRenderer.
+struct FrameParams
+{
+   double rotateX, rotateY, zoom;
+   int clipMode;     // 0 = off, 1 = marching cubes, 2 = direct, 3 = CPU MC
+   double clipX, clipY, clipZ;
+   int tessLevel, explode;
+   bool lines;
+
+   FrameParams()
+      : rotateX(0), rotateY(0), zoom(0)
+      , clipMode(0), clipX(0), clipY(0), clipZ(0)
+      , tessLevel(8), explode(0), lines(true)
+   {}
+
+   /** Throw std::runtime_error if the level is not in 1..MaxTessLevel (the
+       kernels size their shared memory for that) or the clip mode is not
+       one of the above. */
+   void validate() const;
+};
+
+
+/** Renders a solution without a window system: an offscreen OpenGL context
+ *  (EGL, surfaceless, e.g. with Mesa llvmpipe on a compute node) and a
+ *  multisampled framebuffer object. The images are the same as those of
+ *  the interactive RenderWidget for the same parameters.
+ *
+ *  Requires hogtess to be built with EGL (HOGTESS_EGL), throws
+ *  std::runtime_error otherwise or if the context cannot be created.
+ */
+class HeadlessRenderer
+{
+public:
+   HeadlessRenderer(const Solution &solution,
+                    SurfaceCoefs &surfaceCoefs,
+                    VolumeCoefs &volumeCoefs,
+                    int width, int height, int samples = 8);
+
+   ~HeadlessRenderer();
+
+   /** Render one frame. The surface is only tesselated again when the
+       level changes, the cut plane when the clip parameters change. Throws
+       std::runtime_error if 'params' are not valid. */
+   void render(const FrameParams &params);
+
+   /// Read the last frame back and save it (format given by the extension).
+   void save(const std::string &path);
+
+   /** Start reading the last frame back into pixel pack buffer 'slot'
+       (0 or 1) without waiting for it, so that the next frame can be
+       rendered while the transfer completes. */
+   void readback(int slot);
+
+   /// Wait for the readback into 'slot' and return a copy of the image.
+   QImage image(int slot);
+
+   /// See CutPlaneMesh::setVoxelBudget.
+   void setVoxelBudget(long bytes) { cutPlaneMesh.setVoxelBudget(bytes); }
+
+   int getWidth() const { return width; }
+   int getHeight() const { return height; }
+
+protected:
+   const Solution &solution;
+   SurfaceCoefs &surfaceCoefs;
+   VolumeCoefs &volumeCoefs;
+
+   int width, height;
+
+   /** The EGL display and context, released on destruction. Declared
+       before the meshes so that it outlives their GL objects. */
+   struct EglContext
+   {
+      void *display, *context; // EGLDisplay, EGLContext
+
+      EglContext() : display(nullptr), context(nullptr) {}
+      ~EglContext();
+
+      EglContext(const EglContext&) = delete;
+      EglContext& operator=(const EglContext&) = delete;
+   };
+   EglContext egl;
+
+   GLuint fbo, colorRb, depthRb;   // multisampled
+   GLuint resolveFbo, resolveRb;   // for the readback
+   GLuint pbo[2];
+   GLsync fence[2];
+   int stride;
+
+   SurfaceMesh surfaceMesh;
+   CutPlaneMesh cutPlaneMesh;
+   Buffer bufPartMat;
+
+   // parameters of the current meshes, -1 = none yet
+   int meshLevel, cutLevel, cutMode, partExplode;
+   double cutX, cutY, cutZ;
+
+   void createContext();
+   void createFramebuffer(int samples);
+};
+
+
+#endif // hogtess_headless_hpp_included__
@@ -0,0 +1,340 @@
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "input-cache.hpp"
+#include "utility.hpp"
+
+
+static_assert(sizeof(BBox<float>) == 6*sizeof(float),
+              "BBox<float> is stored in the cache as float[6]");
+
+static const char cacheMagic[8] = "HOGTESS";
+static const uint32_t cacheByteOrder = 0x01020304;
+
+
+static std::runtime_error ioError(const std::string &path, const char *what)
+{
+   return std::runtime_error(path + ": " + what + ": " + std::strerror(errno));
+}
+
+
+CacheFile::CacheFile(const std::string &path)
+   : data_(nullptr), size_(0)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) {
+      throw ioError(path, "cannot open cache");
+   }
+
+   struct stat st;
+   if (fstat(fd, &st) < 0) {
+      close(fd);
+      throw ioError(path, "cannot stat cache");
+   }
+   size_ = st.st_size;
+
+   if (size_ < (long) sizeof(CacheHeader)) {
+      close(fd);
+      throw std::runtime_error(path + ": cache file truncated");
+   }
+
+   void *map = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED) {
+      throw ioError(path, "cannot map cache");
+   }
+   data_ = (char*) map;
+
+   const CacheHeader &hdr = header();
+   if (std::memcmp(hdr.magic, cacheMagic, sizeof(cacheMagic)) ||
+       hdr.version != Version ||
+       hdr.byteOrder != cacheByteOrder ||
+       hdr.fileSize != (uint64_t) size_)
+   {
+      munmap(data_, size_);
+      data_ = nullptr;
+      throw std::runtime_error(path + ": invalid or outdated cache file");
+   }
+
+   // all sections must lie within the file, section<T>() relies on it
+   bool valid = hdr.numRanks >= 1 && hdr.order >= 1 && hdr.order <= 64 &&
+                hdr.numFaces >= 0 && hdr.numElements >= 0 &&
+                hdr.faceDofs == (hdr.order+1)*(hdr.order+1) &&
+                hdr.elemDofs == (hdr.order+1)*(hdr.order+1)*(hdr.order+1) &&
+                hdr.inputsSize <= hdr.fileSize;
+   if (valid)
+   {
+      uint64_t sizes[NumSections];
+      sectionSizes(hdr, sizes);
+      for (int i = 0; i < NumSections; i++)
+      {
+         if (hdr.offsets[i] % 64 ||
+             hdr.offsets[i] < sizeof(CacheHeader) ||
+             hdr.offsets[i] > hdr.fileSize ||
+             sizes[i] > hdr.fileSize - hdr.offsets[i])
+         {
+            valid = false;
+         }
+      }
+   }
+   if (!valid)
+   {
+      munmap(data_, size_);
+      data_ = nullptr;
+      throw std::runtime_error(path + ": corrupt cache file");
+   }
+}
+
+
+CacheFile::~CacheFile()
+{
+   if (data_) {
+      munmap(data_, size_);
+   }
+}
+
+
+void CacheFile::sectionSizes(const CacheHeader &hdr, uint64_t *sizes)
+{
+   uint64_t nf = hdr.numFaces, ne = hdr.numElements;
+
+   sizes[Nodes1D] = sizeof(double)*(hdr.order + 1);
+   sizes[Centers] = sizeof(double)*3*hdr.numRanks;
+   sizes[FaceCoefs] = sizeof(float)*4*nf*hdr.faceDofs;
+   sizes[FaceRanks] = sizeof(int)*nf;
+   sizes[ElemCoefs] = sizeof(float)*4*ne*hdr.elemDofs;
+   sizes[ElemRanks] = sizeof(int)*ne;
+   sizes[ElemBoxes] = sizeof(BBox<float>)*ne;
+   sizes[Inputs] = hdr.inputsSize;
+}
+
+
+std::string CacheFile::inputSignature(const std::vector<std::string> &inputs)
+{
+   std::ostringstream sig;
+   for (const auto &input : inputs)
+   {
+      struct stat st;
+      if (stat(input.c_str(), &st) < 0) {
+         return std::string();
+      }
+      long long mtime = (long long) st.st_mtim.tv_sec * 1000000000LL
+                        + st.st_mtim.tv_nsec;
+      sig << input << " " << (long long) st.st_size << " " << mtime << "\n";
+   }
+   return sig.str();
+}
+
+
+bool CacheFile::matches(const std::string &signature, int numRanks) const
+{
+   const CacheHeader &hdr = header();
+   return !signature.empty() &&
+          hdr.numRanks == numRanks &&
+          hdr.inputsSize == signature.size() &&
+          !std::memcmp(section<char>(Inputs), signature.data(),
+                       signature.size());
+}
+
+
+void CacheFile::write(const std::string &path,
+                      const std::string &signature,
+                      const Solution &solution,
+                      SurfaceCoefs &surfaceCoefs,
+                      VolumeCoefs &volumeCoefs)
+{
+   surfaceCoefs.prepare(solution);
+   volumeCoefs.prepare(solution);
+
+   long nf = surfaceCoefs.numFaces(), ne = volumeCoefs.numElements();
+
+   CacheHeader hdr;
+   std::memset(&hdr, 0, sizeof(hdr));
+   std::memcpy(hdr.magic, cacheMagic, sizeof(cacheMagic));
+   hdr.version = Version;
+   hdr.byteOrder = cacheByteOrder;
+   hdr.numRanks = solution.numRanks();
+   hdr.order = solution.order();
+   hdr.numFaces = nf;
+   hdr.faceDofs = surfaceCoefs.numDofs();
+   hdr.numElements = ne;
+   hdr.elemDofs = volumeCoefs.numDofs();
+   for (int i = 0; i < 4; i++)
+   {
+      hdr.min[i] = solution.min(i);
+      hdr.max[i] = solution.max(i);
+      hdr.scale[i] = solution.normScale(i);
+      hdr.offset[i] = solution.normOffset(i);
+   }
+   hdr.inputsSize = signature.size();
+
+   uint64_t sizes[NumSections];
+   sectionSizes(hdr, sizes);
+
+   // lay out the sections
+   const long align = 64;
+   long offsets[NumSections];
+   long size = roundUpMultiple(long(sizeof(CacheHeader)), align);
+   for (int i = 0; i < NumSections; i++)
+   {
+      offsets[i] = size;
+      size = roundUpMultiple(size + long(sizes[i]), align);
+   }
+   for (int i = 0; i < NumSections; i++)
+   {
+      hdr.offsets[i] = offsets[i];
+   }
+   hdr.fileSize = size;
+
+   // write to a temporary file first, rename when complete
+   std::string tmpPath = path + ".tmp";
+
+   int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      throw ioError(tmpPath, "cannot create cache");
+   }
+   if (ftruncate(fd, size) < 0) {
+      close(fd);
+      unlink(tmpPath.c_str());
+      throw ioError(tmpPath, "cannot resize cache");
+   }
+
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED) {
+      unlink(tmpPath.c_str());
+      throw ioError(tmpPath, "cannot map cache");
+   }
+   char *data = (char*) map;
+
+   std::memcpy(data, &hdr, sizeof(hdr));
+   std::memcpy(data + offsets[Nodes1D], solution.nodes1d(), sizes[Nodes1D]);
+   std::memcpy(data + offsets[Inputs], signature.data(), sizes[Inputs]);
+
+   double *centers = (double*) (data + offsets[Centers]);
+   for (int rank = 0; rank < solution.numRanks(); rank++)
+   {
+      std::memcpy(centers + 3*rank, solution.partCenter(rank),
+                  3*sizeof(double));
+   }
+
+   // extract the coefficients directly into the mapped file
+   surfaceCoefs.extractHost(solution, 0, nf,
+                            (float*) (data + offsets[FaceCoefs]),
+                            (int*) (data + offsets[FaceRanks]));
+
+   volumeCoefs.extractHost(solution, 0, ne,
+                           (float*) (data + offsets[ElemCoefs]),
+                           (int*) (data + offsets[ElemRanks]));
+
+   BBox<float> *boxes = (BBox<float>*) (data + offsets[ElemBoxes]);
+   for (long i = 0; i < ne; i++)
+   {
+      boxes[i] = volumeCoefs.boundingBox(i);
+   }
+
+   int err = msync(data, size, MS_SYNC);
+   munmap(data, size);
+
+   if (err < 0 || rename(tmpPath.c_str(), path.c_str()) < 0)
+   {
+      std::runtime_error e = ioError(path, "cannot write cache");
+      unlink(tmpPath.c_str());
+      throw e;
+   }
+
+   std::cout << "Wrote cache " << path << " ("
+             << double(size)/(1024*1024) << " MB)." << std::endl;
+}
+
+
+CachedSolution::CachedSolution(const std::shared_ptr<const CacheFile> &cache)
+   : cache_(cache)
+{
+   const CacheHeader &hdr = cache->header();
+
+   numRanks_ = hdr.numRanks;
+   order_ = hdr.order;
+   nodes1d_ = cache->section<double>(CacheFile::Nodes1D);
+
+   for (int i = 0; i < 4; i++)
+   {
+      min_[i] = hdr.min[i];
+      max_[i] = hdr.max[i];
+      scale_[i] = hdr.scale[i];
+      offset_[i] = hdr.offset[i];
+   }
+
+   const double *centers = cache->section<double>(CacheFile::Centers);
+   centers_.assign(centers, centers + 3*numRanks_);
+}
+
+
+void CachedSurfaceCoefs::prepare(const Solution &)
+{
+   nf_ = cache_->header().numFaces;
+   ndof_ = cache_->header().faceDofs;
+}
+
+void CachedSurfaceCoefs::extractHost(const Solution &solution,
+                                     long begin, long end,
+                                     float *coefs, int *ranks)
+{
+   std::memcpy(coefs, cache_->section<float>(CacheFile::FaceCoefs)
+                      + 4*begin*ndof_,
+               4*sizeof(float)*(end - begin)*ndof_);
+   std::memcpy(ranks, cache_->section<int>(CacheFile::FaceRanks) + begin,
+               sizeof(int)*(end - begin));
+}
+
+void CachedSurfaceCoefs::extract(const Solution &solution)
+{
+   prepare(solution);
+   buffer_.upload(cache_->section<float>(CacheFile::FaceCoefs),
+                  4*sizeof(float)*long(nf_)*ndof_);
+   ranks_.upload(cache_->section<int>(CacheFile::FaceRanks),
+                 sizeof(int)*nf_);
+}
+
+
+void CachedVolumeCoefs::prepare(const Solution &)
+{
+   ne_ = cache_->header().numElements;
+   ndof_ = cache_->header().elemDofs;
+
+   const auto *boxes = cache_->section<BBox<float>>(CacheFile::ElemBoxes);
+   boxes_.assign(boxes, boxes + ne_);
+}
+
+void CachedVolumeCoefs::extractHost(const Solution &solution,
+                                    long begin, long end,
+                                    float *coefs, int *ranks)
+{
+   std::memcpy(coefs, cache_->section<float>(CacheFile::ElemCoefs)
+                      + 4*begin*ndof_,
+               4*sizeof(float)*(end - begin)*ndof_);
+   std::memcpy(ranks, cache_->section<int>(CacheFile::ElemRanks) + begin,
+               sizeof(int)*(end - begin));
+}
+
+void CachedVolumeCoefs::extract(const Solution &solution)
+{
+   prepare(solution);
+
+   const int *ranks = cache_->section<int>(CacheFile::ElemRanks);
+   buffer_.upload(cache_->section<float>(CacheFile::ElemCoefs),
+                  4*sizeof(float)*long(ne_)*ndof_);
+   ranks_.upload(ranks, sizeof(int)*ne_);
+   ranks_.copy(ranks, sizeof(int)*ne_);
+   boxBuffer_.upload(boxes_);
+}
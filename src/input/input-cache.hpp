@@ -0,0 +1,148 @@
+#ifndef hogtess_input_cache_hpp_included_
+#define hogtess_input_cache_hpp_included_
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "input.hpp"
+
+
+/** Header of the binary coefficient cache file. The file starts with this
+ *  header, followed by the sections listed in CacheFile::Section, each
+ *  aligned to 64 bytes. All data is stored in host byte order.
+ */
+struct CacheHeader
+{
+   char magic[8];          // "HOGTESS"
+   uint32_t version;       // CacheFile::Version
+   uint32_t byteOrder;     // 0x01020304 in host byte order
+
+   int32_t numRanks, order;
+   int32_t numFaces, faceDofs;
+   int32_t numElements, elemDofs;
+
+   double min[4], max[4];
+   double scale[4], offset[4];
+
+   uint64_t offsets[8];    // section offsets (indexed by CacheFile::Section)
+   uint64_t fileSize;
+   uint64_t inputsSize;    // length of the Inputs section
+};
+
+
+/** A memory-mapped binary cache of everything hogtess needs from a
+ *  solution: the vec4 face and element coefficients, ranks, element
+ *  bounding boxes, normalization, part centers and the 1D nodes. With a
+ *  valid cache the GPU upload can start right away, without parsing the
+ *  input files.
+ */
+class CacheFile
+{
+public:
+   enum { Version = 2 };
+
+   enum Section
+   {
+      Nodes1D,     // double[order+1]
+      Centers,     // double[3*numRanks]
+      FaceCoefs,   // float[4*numFaces*faceDofs]
+      FaceRanks,   // int[numFaces]
+      ElemCoefs,   // float[4*numElements*elemDofs]
+      ElemRanks,   // int[numElements]
+      ElemBoxes,   // BBox<float>[numElements]
+      Inputs,      // char[inputsSize], see inputSignature()
+      NumSections
+   };
+
+   /** Map an existing cache file. Throws std::runtime_error if not valid,
+       i.e., if the header is not of this version or if any section does not
+       fit in the file. */
+   CacheFile(const std::string &path);
+
+   ~CacheFile();
+
+   const CacheHeader& header() const { return *(const CacheHeader*) data_; }
+
+   /// Access a section of the file as "const T*".
+   template<typename T>
+   const T* section(Section s) const
+   {
+      return (const T*) (data_ + header().offsets[s]);
+   }
+
+   /** Describe the input files: one line with the path, the size and the
+       modification time (in ns) of each file. Returns an empty string if
+       any of them cannot be accessed. */
+   static std::string inputSignature(const std::vector<std::string> &inputs);
+
+   /** Return true if the cache was written from inputs with the given
+       signature and number of ranks (see inputSignature()). */
+   bool matches(const std::string &signature, int numRanks) const;
+
+   /** Extract all coefficients of 'solution' (on the host) and store them
+       to a new cache file, together with the 'signature' of the inputs
+       (taken before they were loaded). Throws std::runtime_error on I/O
+       errors. */
+   static void write(const std::string &path,
+                     const std::string &signature,
+                     const Solution &solution,
+                     SurfaceCoefs &surfaceCoefs,
+                     VolumeCoefs &volumeCoefs);
+
+protected:
+   char *data_;
+   long size_;
+
+   /// Size in bytes of each section for the counts in 'hdr'.
+   static void sectionSizes(const CacheHeader &hdr, uint64_t *sizes);
+};
+
+
+/// Solution stored in a CacheFile.
+class CachedSolution : public Solution
+{
+public:
+   CachedSolution(const std::shared_ptr<const CacheFile> &cache);
+
+protected:
+   std::shared_ptr<const CacheFile> cache_;
+};
+
+
+/// Face coefficients stored in a CacheFile, uploaded directly from the map.
+class CachedSurfaceCoefs : public SurfaceCoefs
+{
+public:
+   CachedSurfaceCoefs(const std::shared_ptr<const CacheFile> &cache)
+      : SurfaceCoefs(), cache_(cache) {}
+
+   virtual void prepare(const Solution &solution);
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks);
+   virtual void extract(const Solution &solution);
+
+protected:
+   std::shared_ptr<const CacheFile> cache_;
+};
+
+
+/// Element coefficients stored in a CacheFile, uploaded directly from the map.
+class CachedVolumeCoefs : public VolumeCoefs
+{
+public:
+   CachedVolumeCoefs(const std::shared_ptr<const CacheFile> &cache)
+      : VolumeCoefs(), cache_(cache) {}
+
+   virtual void prepare(const Solution &solution);
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks);
+   virtual void extract(const Solution &solution);
+
+protected:
+   std::shared_ptr<const CacheFile> cache_;
+};
+
+
+#endif // hogtess_input_cache_hpp_included_
@@ -8,50 +8,51 @@
 using namespace mfem;
 
 
-MFEMSolution::MFEMSolution(const std::vector<std::string> &meshPaths,
-                           const std::vector<std::string> &solutionPaths)
+// std::cout is not synchronized, print whole lines from OMP loops
+static void printLine(const std::string &line)
 {
-   MFEM_VERIFY(meshPaths.size() == solutionPaths.size(), "");
-
-   numRanks_ = meshPaths.size();
-   meshes_.resize(numRanks_);
-   solutions_.resize(numRanks_);
+   OMP(critical(cout))
+   std::cout << line << std::endl;
+}
 
-   order_ = -1;
 
-   // load mesh & solution for each rank
-   OMP(parallel for schedule(dynamic))
-   for (int rank = 0; rank < numRanks_; rank++)
+/** Load mesh and solution of one rank, elevate the curvature if needed.
+ *  Return an error message instead of aborting, so that errors from OMP
+ *  threads can be reported deterministically by the caller.
+ */
+static std::string loadRank(const std::string &meshPath,
+                            const std::string &solutionPath,
+                            std::unique_ptr<Mesh> &meshPtr,
+                            std::unique_ptr<GridFunction> &slnPtr,
+                            int &order)
+{
+   try
    {
-      std::cout << "Loading " << meshPaths[rank] << std::endl;
-      mfem::Mesh *mesh = new Mesh(meshPaths[rank].c_str());
+      printLine("Loading " + meshPath);
+      mfem::Mesh *mesh = new Mesh(meshPath.c_str());
+      meshPtr.reset(mesh);
 
       Geometry::Type geom = Geometry::CUBE;
-      MFEM_VERIFY(mesh->Dimension() == 3 &&
-                  mesh->GetNumGeometries(mesh->Dimension()) == 1 &&
-                  mesh->GetElementBaseGeometry(0) == geom,
-                  "Only 3D hexes supported so far, sorry.");
+      if (mesh->Dimension() != 3 ||
+          mesh->GetNumGeometries(mesh->Dimension()) != 1 ||
+          mesh->GetElementBaseGeometry(0) != geom)
+      {
+         return "Only 3D hexes supported so far, sorry.";
+      }
 
-      std::cout << "Loading " << solutionPaths[rank] << std::endl;
-      std::ifstream is(solutionPaths[rank].c_str());
+      printLine("Loading " + solutionPath);
+      std::ifstream is(solutionPath.c_str());
+      if (!is) {
+         return "Cannot open " + solutionPath;
+      }
       mfem::GridFunction *sln = new GridFunction(mesh, is);
+      slnPtr.reset(sln);
       is.close();
 
       const FiniteElement* slnFE =
          sln->FESpace()->FEColl()->FiniteElementForGeometry(geom);
 
-      int order = slnFE->GetOrder();
-
-      OMP(critical)
-      {
-         if (order_ < 0) {
-            order_ = order;
-         }
-         else {
-            MFEM_VERIFY(order == order_,
-                        "All solutions must have the same polynomial order.");
-         }
-      }
+      order = slnFE->GetOrder();
 
       // ensure the mesh has Nodes
       if (mesh->GetNodes() == NULL)
@@ -70,11 +71,62 @@ MFEMSolution::MFEMSolution(const std::vector<std::string> &meshPaths,
                ->FiniteElementForGeometry(geom);
       }
 
-      MFEM_VERIFY(slnFE->GetDof() == meshFE->GetDof(),
-                  "Only isoparametric elements are supported at the moment.");
+      if (slnFE->GetDof() != meshFE->GetDof())
+      {
+         return "Only isoparametric elements are supported at the moment.";
+      }
+   }
+   catch (const std::exception &e)
+   {
+      // MFEM built with MFEM_USE_EXCEPTIONS
+      return e.what();
+   }
+   return std::string();
+}
+
+
+MFEMSolution::MFEMSolution(const std::vector<std::string> &meshPaths,
+                           const std::vector<std::string> &solutionPaths)
+{
+   MFEM_VERIFY(meshPaths.size() == solutionPaths.size(), "");
+   MFEM_VERIFY(meshPaths.size() > 0, "No mesh to load.");
+
+   numRanks_ = meshPaths.size();
+   meshes_.resize(numRanks_);
+   solutions_.resize(numRanks_);
+
+   std::vector<int> orders(numRanks_, -1);
+   std::vector<std::string> errors(numRanks_);
+
+   // NOTE: rank 0 is loaded alone first, so that the global caches of MFEM
+   // (poly1d, FE collections) are populated before the remaining ranks are
+   // loaded concurrently
+   errors[0] = loadRank(meshPaths[0], solutionPaths[0],
+                        meshes_[0], solutions_[0], orders[0]);
+
+   if (errors[0].empty())
+   {
+      OMP(parallel for schedule(dynamic))
+      for (int rank = 1; rank < numRanks_; rank++)
+      {
+         errors[rank] = loadRank(meshPaths[rank], solutionPaths[rank],
+                                 meshes_[rank], solutions_[rank],
+                                 orders[rank]);
+      }
+   }
+
+   // report the first failed rank, independently of thread scheduling
+   for (int rank = 0; rank < numRanks_; rank++)
+   {
+      MFEM_VERIFY(errors[rank].empty(),
+                  meshPaths[rank] << ": " << errors[rank]);
+   }
 
-      meshes_[rank].reset(mesh);
-      solutions_[rank].reset(sln);
+   order_ = orders[0];
+   for (int rank = 1; rank < numRanks_; rank++)
+   {
+      MFEM_VERIFY(orders[rank] == order_,
+                  "All solutions must have the same polynomial order.");
    }
 
    std::cout << "Polynomial order: " << order_ << std::endl;
@@ -104,22 +156,33 @@ static void updateMinMax(const GridFunction *gf, int vd,
 void MFEMSolution::getMinMaxNorm()
 {
    // calculate the approximate min/max of the solution and the domain
-   for (int i = 0; i < 4; i++)
-   {
-      min_[i] = std::numeric_limits<double>::max();
-      max_[i] = std::numeric_limits<double>::lowest();
-   }
-   for (unsigned rank = 0; rank < numRanks_; rank++)
+   std::vector<double> rankMin(4*numRanks_, std::numeric_limits<double>::max());
+   std::vector<double> rankMax(4*numRanks_, std::numeric_limits<double>::lowest());
+
+   OMP(parallel for schedule(dynamic))
+   for (int rank = 0; rank < numRanks_; rank++)
    {
+      double *min = &rankMin[4*rank], *max = &rankMax[4*rank];
+
       const auto *nodes = meshes_[rank]->GetNodes();
       for (int i = 0; i < nodes->FESpace()->GetVDim(); i++)
       {
-         updateMinMax(nodes, i, min_[i], max_[i]);
+         updateMinMax(nodes, i, min[i], max[i]);
       }
-      updateMinMax(solutions_[rank].get(), 0, min_[3], max_[3]);
+      updateMinMax(solutions_[rank].get(), 0, min[3], max[3]);
    }
+
+   // reduce in rank order
    for (int i = 0; i < 4; i++)
    {
+      min_[i] = std::numeric_limits<double>::max();
+      max_[i] = std::numeric_limits<double>::lowest();
+
+      for (int rank = 0; rank < numRanks_; rank++)
+      {
+         min_[i] = std::min(rankMin[4*rank + i], min_[i]);
+         max_[i] = std::max(rankMax[4*rank + i], max_[i]);
+      }
       if (min_[i] > max_[i]) { min_[i] = max_[i] = 0; }
    }
 
@@ -143,7 +206,8 @@ void MFEMSolution::getCenters()
    centers_.clear();
    centers_.resize(3*numRanks_, 0.0);
 
-   for (unsigned rank = 0; rank < numRanks_; rank++)
+   OMP(parallel for schedule(dynamic))
+   for (int rank = 0; rank < numRanks_; rank++)
    {
       const auto *nodes = meshes_[rank]->GetNodes();
       const auto *fes = nodes->FESpace();
@@ -170,16 +234,19 @@ MFEMSolution::~MFEMSolution()
 }
 
 
-void MFEMSurfaceCoefs::extract(const Solution &solution)
+static const MFEMSolution* mfemSolution(const Solution &solution)
 {
-   int numRanks = solution.numRanks();
-
    const auto *msln = dynamic_cast<const MFEMSolution*>(&solution);
    MFEM_VERIFY(msln, "Not an MFEM solution!");
+   return msln;
+}
+
 
-   // check the finite element types
-   const H1_QuadrilateralElement* fe;
-   for (int rank = 0; rank < numRanks; rank++)
+// check the finite element types, return the face element
+static const H1_QuadrilateralElement* faceElement(const MFEMSolution *msln)
+{
+   const H1_QuadrilateralElement* fe = NULL;
+   for (int rank = 0; rank < msln->numRanks(); rank++)
    {
       const auto *slnSpace = msln->solution(rank)->FESpace();
       const auto *nodesSpace = msln->mesh(rank)->GetNodes()->FESpace();
@@ -195,92 +262,194 @@ void MFEMSurfaceCoefs::extract(const Solution &solution)
                   "Curvature currently must have the same space as the solution.");
       fe = slnFE;
    }
-   int ndof = fe->GetDof();
+   return fe;
+}
 
-   // count boundary faces
-   std::vector<int> faceOffset(numRanks+1, 0);
-   for (int rank = 0; rank < numRanks; rank++)
+
+/** Build the lexicographic gather index of a FE space: the scalar DOFs of
+ *  elements (or boundary elements) [first, first+n) in the tensor-product
+ *  order of the
+ *  shaders. The index is built once per space and then used for all vector
+ *  components, so the extraction itself needs no Array<int> per element.
+ */
+static void gatherIndex(const FiniteElementSpace *fes, bool boundary,
+                        const Array<int> &dofMap, int first, int n,
+                        std::vector<int> &index)
+{
+   int ndof = dofMap.Size();
+   index.resize(long(n)*ndof);
+
+   OMP(parallel)
    {
-      const Mesh *mesh = msln->mesh(rank);
-      faceOffset[rank+1] = faceOffset[rank] + mesh->GetNBE();
+      Array<int> dofs; // one per thread, reused
+
+      OMP(for schedule(static))
+      for (int i = 0; i < n; i++)
+      {
+         if (boundary) {
+            fes->GetBdrElementDofs(first + i, dofs);
+         }
+         else {
+            fes->GetElementDofs(first + i, dofs);
+         }
+         MFEM_ASSERT(dofs.Size() == ndof, "");
+
+         int *idx = &index[long(i)*ndof];
+         for (int j = 0; j < ndof; j++)
+         {
+            idx[j] = dofs[dofMap[j]];
+         }
+      }
    }
-   nf_ = faceOffset[numRanks];
+}
 
-   // CPU instances of the buffers
-   std::vector<float> faceCoefs(4*nf_*ndof, 0.f);
-   std::vector<int> ranks(nf_, 0);
 
-   // extract coefficients
-   OMP(parallel for schedule(dynamic))
-   for (int rank = 0; rank < numRanks; rank++)
+/// Strides such that vdof = dof*dofStride + vd*vdStride.
+static void vdofStrides(const FiniteElementSpace *fes,
+                        long &dofStride, long &vdStride)
+{
+   if (fes->GetOrdering() == Ordering::byNODES)
+   {
+      dofStride = 1;
+      vdStride = fes->GetNDofs();
+   }
+   else
+   {
+      dofStride = fes->GetVDim();
+      vdStride = 1;
+   }
+}
+
+
+/// Gather and normalize one component: out[4*j] = (data[idx[j]] + o)*s
+static inline void gatherComponent(const double * __restrict data,
+                                   const int * __restrict idx,
+                                   int n, long stride,
+                                   double offset, double scale,
+                                   float * __restrict out)
+{
+   OMP(simd)
+   for (int j = 0; j < n; j++)
+   {
+      out[4*j] = float((data[idx[j]*stride] + offset)*scale);
+   }
+}
+
+
+/** Extract the vec4 coefficients of elements (boundary elements) [begin, end)
+ *  of 'msln', numbered consecutively over all ranks, to 'allCoefs'. Runs in
+ *  parallel over the elements of each rank. If 'boxes' is not NULL, element
+ *  bounding boxes [begin, end) are also computed.
+ */
+static void extractCoefs(const MFEMSolution *msln, bool boundary,
+                         const Array<int> &dofMap, long begin, long end,
+                         float *allCoefs, int *ranks, BBox<float> *boxes)
+{
+   int ndof = dofMap.Size();
+   std::vector<int> slnIndex, nodesIndex;
+
+   long offset = 0;
+   for (int rank = 0; rank < msln->numRanks() && offset < end; rank++)
    {
       const Mesh *mesh = msln->mesh(rank);
+      long count = boundary ? mesh->GetNBE() : mesh->GetNE();
+
+      // local range of this rank within [begin, end)
+      long first = std::max(begin - offset, 0L);
+      long last = std::min(end - offset, count);
+      if (first >= last) {
+         offset += count;
+         continue;
+      }
+      int n = last - first;
 
       const GridFunction *gf = msln->solution(rank);
       const GridFunction *nodes = mesh->GetNodes();
 
       const auto *slnSpace = gf->FESpace();
       const auto *nodesSpace = nodes->FESpace();
+      int vdim = nodesSpace->GetVDim();
 
-      Array<int> dofs, vdofs;
-      const Array<int> &dofMap = fe->GetDofMap();
+      gatherIndex(slnSpace, boundary, dofMap, first, n, slnIndex);
+      gatherIndex(nodesSpace, boundary, dofMap, first, n, nodesIndex);
 
-      // extract face coefs
-      for (int i = 0, nf = 0; i < mesh->GetNBE(); i++)
-      {
-         int fi = faceOffset[rank] + i;
-         ranks[fi] = rank;
+      long slnStride, slnVdStride, nodesStride, nodesVdStride;
+      vdofStrides(slnSpace, slnStride, slnVdStride);
+      vdofStrides(nodesSpace, nodesStride, nodesVdStride);
 
-         float* coefs = &(faceCoefs[4*fi*ndof]);
+      const double *slnData = gf->GetData();
+      const double *nodesData = nodes->GetData();
 
-         slnSpace->GetBdrElementDofs(i, dofs);
-         MFEM_ASSERT(dofs.Size() == ndof, "");
+      OMP(parallel for schedule(static))
+      for (int i = 0; i < n; i++)
+      {
+         long ei = offset + first + i; // global index
+         ranks[ei - begin] = rank;
 
-         dofs.Copy(vdofs);
-         slnSpace->DofsToVDofs(0, vdofs);
+         float* coefs = allCoefs + 4*(ei - begin)*ndof;
 
-         for (int j = 0; j < ndof; j++)
+         gatherComponent(slnData, &slnIndex[long(i)*ndof], ndof, slnStride,
+                         msln->normOffset(3), msln->normScale(3), coefs + 3);
+
+         for (int vd = 0; vd < vdim; vd++)
          {
-            double c = (*gf)(vdofs[dofMap[j]]);
-            coefs[4*j + 3] = (c + msln->normOffset(3))*msln->normScale(3);
+            gatherComponent(nodesData + vd*nodesVdStride,
+                            &nodesIndex[long(i)*ndof], ndof, nodesStride,
+                            msln->normOffset(vd), msln->normScale(vd),
+                            coefs + vd);
          }
 
-         nodesSpace->GetBdrElementDofs(i, dofs);
-         MFEM_ASSERT(dofs.Size() == ndof, "");
-
-         for (int vd = 0; vd < nodesSpace->GetVDim(); vd++)
+         if (boxes)
          {
-            dofs.Copy(vdofs);
-            nodesSpace->DofsToVDofs(vd, vdofs);
-
-            double min = msln->min(vd);
-            double scale = 1.0/(msln->max(vd) - min);
-
+            BBox<float> box;
             for (int j = 0; j < ndof; j++)
             {
-               double c = (*nodes)(vdofs[dofMap[j]]);
-               coefs[4*j + vd] = (c + msln->normOffset(vd))*msln->normScale(vd);
+               for (int vd = 0; vd < vdim; vd++)
+               {
+                  box.update(coefs[4*j + vd], vd);
+               }
             }
+            boxes[ei] = box;
          }
       }
+
+      offset += count;
    }
+}
 
-   // upload to shader buffers
-   buffer_.upload(faceCoefs);
-   ranks_.upload(ranks);
+
+void MFEMSurfaceCoefs::prepare(const Solution &solution)
+{
+   const auto *msln = mfemSolution(solution);
+
+   ndof_ = faceElement(msln)->GetDof();
+
+   // count boundary faces
+   nf_ = 0;
+   for (int rank = 0; rank < msln->numRanks(); rank++)
+   {
+      nf_ += msln->mesh(rank)->GetNBE();
+   }
 }
 
 
-void MFEMVolumeCoefs::extract(const Solution &solution)
+void MFEMSurfaceCoefs::extractHost(const Solution &solution,
+                                   long begin, long end,
+                                   float *faceCoefs, int *ranks)
 {
-   int numRanks = solution.numRanks();
+   const auto *msln = mfemSolution(solution);
+   const H1_QuadrilateralElement* fe = faceElement(msln);
 
-   const auto *msln = dynamic_cast<const MFEMSolution*>(&solution);
-   MFEM_VERIFY(msln, "Not an MFEM solution!");
+   extractCoefs(msln, true, fe->GetDofMap(), begin, end,
+                faceCoefs, ranks, NULL);
+}
 
-   // check the finite element types
-   const H1_HexahedronElement* fe;
-   for (int rank = 0; rank < numRanks; rank++)
+
+// check the finite element types, return the volume element
+static const H1_HexahedronElement* volumeElement(const MFEMSolution *msln)
+{
+   const H1_HexahedronElement* fe = NULL;
+   for (int rank = 0; rank < msln->numRanks(); rank++)
    {
       const auto *slnSpace = msln->solution(rank)->FESpace();
       const auto *nodesSpace = msln->mesh(rank)->GetNodes()->FESpace();
@@ -296,81 +465,35 @@ void MFEMVolumeCoefs::extract(const Solution &solution)
                   "Curvature currently must have the same space as the solution.");
       fe = slnFE;
    }
-   int ndof = fe->GetDof();
+   return fe;
+}
+
+
+void MFEMVolumeCoefs::prepare(const Solution &solution)
+{
+   const auto *msln = mfemSolution(solution);
+
+   ndof_ = volumeElement(msln)->GetDof();
 
    // count elements
-   std::vector<int> elemOffset(numRanks+1, 0);
-   for (int rank = 0; rank < numRanks; rank++)
+   ne_ = 0;
+   for (int rank = 0; rank < msln->numRanks(); rank++)
    {
-      const Mesh *mesh = msln->mesh(rank);
-      elemOffset[rank+1] = elemOffset[rank] + mesh->GetNE();
+      ne_ += msln->mesh(rank)->GetNE();
    }
-   ne_ = elemOffset[numRanks];
-
-   // CPU instances of the buffers
-   std::vector<float> elemCoefs(4*ne_*ndof, 0.f);
-   std::vector<int> ranks(ne_, 0);
 
    boxes_.clear();
    boxes_.resize(ne_);
+}
 
-   // extract coefficients
-   OMP(parallel for schedule(dynamic))
-   for (int rank = 0; rank < numRanks; rank++)
-   {
-      const Mesh *mesh = msln->mesh(rank);
-
-      const GridFunction *gf = msln->solution(rank);
-      const GridFunction *nodes = msln->mesh(rank)->GetNodes();
-
-      const auto *slnSpace = gf->FESpace();
-      const auto *nodesSpace = nodes->FESpace();
-
-      Array<int> dofs, vdofs;
-      const Array<int> &dofMap = fe->GetDofMap();
-
-      // extract element coefficients
-      for (int i = 0; i < mesh->GetNE(); i++)
-      {
-         int ei = elemOffset[rank] + i;
-         ranks[ei] = rank;
-
-         float* coefs = &(elemCoefs[4*ei*ndof]);
-
-         slnSpace->GetElementDofs(i, dofs);
-         MFEM_ASSERT(dofs.Size() == ndof, "");
-
-         dofs.Copy(vdofs);
-         slnSpace->DofsToVDofs(0, vdofs);
-
-         for (int j = 0; j < ndof; j++)
-         {
-            double c = (*gf)(vdofs[dofMap[j]]);
-            coefs[4*j + 3] = (c + msln->normOffset(3))*msln->normScale(3);
-         }
-
-         nodesSpace->GetElementDofs(i, dofs);
-         MFEM_ASSERT(dofs.Size() == ndof, "");
-
-         for (int vd = 0; vd < nodesSpace->GetVDim(); vd++)
-         {
-            dofs.Copy(vdofs);
-            nodesSpace->DofsToVDofs(vd, vdofs);
 
-            for (int j = 0; j < ndof; j++)
-            {
-               double c = (*nodes)(vdofs[dofMap[j]]);
-               c = (c + msln->normOffset(vd))*msln->normScale(vd);
-               coefs[4*j + vd] = c;
-               boxes_[ei].update(c, vd);
-            }
-         }
-      }
-   }
+void MFEMVolumeCoefs::extractHost(const Solution &solution,
+                                  long begin, long end,
+                                  float *elemCoefs, int *ranks)
+{
+   const auto *msln = mfemSolution(solution);
+   const H1_HexahedronElement* fe = volumeElement(msln);
 
-   // upload to shader buffers
-   buffer_.upload(elemCoefs);
-   ranks_.upload(ranks);
-   ranks_.copy(ranks);
+   extractCoefs(msln, false, fe->GetDofMap(), begin, end,
+                elemCoefs, ranks, boxes_.data());
 }
-
@@ -31,18 +31,12 @@ public:
       return solutions_[rank].get();
    }
 
-   // normalization coefficients (0,1,2=domain, 3=solution)
-   double normScale(int i) const { return scale_[i]; }
-   double normOffset(int i) const { return offset_[i]; }
-
    virtual ~MFEMSolution();
 
 protected:
    std::vector<std::unique_ptr<mfem::Mesh>> meshes_;
    std::vector<std::unique_ptr<mfem::GridFunction>> solutions_;
 
-   double scale_[4], offset_[4];
-
    void getMinMaxNorm();
    void getCenters();
 };
@@ -53,7 +47,9 @@ class MFEMSurfaceCoefs : public SurfaceCoefs
 public:
    MFEMSurfaceCoefs() : SurfaceCoefs() {}
 
-   virtual void extract(const Solution &solution);
+   virtual void prepare(const Solution &solution);
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks);
 };
 
 
@@ -62,7 +58,9 @@ class MFEMVolumeCoefs : public VolumeCoefs
 public:
    MFEMVolumeCoefs() : VolumeCoefs() {}
 
-   virtual void extract(const Solution &solution);
+   virtual void prepare(const Solution &solution);
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks);
 };
 
 
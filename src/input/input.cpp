@@ -0,0 +1,97 @@
+#include <future>
+#include <algorithm>
+
+#include "input.hpp"
+#include "profiler.hpp"
+
+
+// size of one host staging chunk of coefficients
+static const long ChunkBytes = 32*1024*1024;
+
+
+/** Extract 'n' items of 'itemFloats' floats each in chunks, using
+ *  'extractChunk(begin, end, coefs)', and upload them to 'buffer'. Chunk k
+ *  is uploaded (on the GL thread) while chunk k+1 is being extracted on
+ *  another thread, so at most two staging chunks exist at any time.
+ */
+template<typename ExtractFunc>
+static void streamUpload(Buffer &buffer, long n, long itemFloats,
+                         ExtractFunc extractChunk)
+{
+   const long itemBytes = itemFloats*sizeof(float);
+   const long chunk = std::max(1L, ChunkBytes / itemBytes);
+
+   buffer.resize(n*itemBytes);
+   if (!n) { return; }
+
+   std::vector<float> staging[2];
+   staging[0].resize(std::min(chunk, n)*itemFloats);
+   staging[1].resize(staging[0].size());
+
+   extractChunk(0, std::min(chunk, n), staging[0].data());
+
+   for (long begin = 0, k = 0; begin < n; begin += chunk, k ^= 1)
+   {
+      long end = std::min(begin + chunk, n);
+
+      std::future<void> next;
+      if (end < n)
+      {
+         next = std::async(std::launch::async, extractChunk,
+                           end, std::min(end + chunk, n),
+                           staging[k ^ 1].data());
+      }
+
+      {
+         PROFILE_ZONE("upload chunk");
+         buffer.upload(staging[k].data(), (end - begin)*itemBytes,
+                       begin*itemBytes);
+      }
+
+      if (next.valid()) {
+         next.get(); // rethrows extraction errors
+      }
+   }
+}
+
+
+void SurfaceCoefs::extract(const Solution &solution)
+{
+   PROFILE_ZONE("extract faces");
+
+   prepare(solution);
+
+   std::vector<int> ranks(nf_, 0);
+
+   streamUpload(buffer_, nf_, 4*ndof_,
+      [&](long begin, long end, float *coefs)
+      {
+         PROFILE_ZONE("extract chunk");
+         extractHost(solution, begin, end, coefs, ranks.data() + begin);
+      });
+
+   ranks_.upload(ranks);
+}
+
+
+void VolumeCoefs::extract(const Solution &solution)
+{
+   PROFILE_ZONE("extract elements");
+
+   prepare(solution);
+
+   std::vector<int> ranks(ne_, 0);
+
+   streamUpload(buffer_, ne_, 4*ndof_,
+      [&](long begin, long end, float *coefs)
+      {
+         PROFILE_ZONE("extract chunk");
+         extractHost(solution, begin, end, coefs, ranks.data() + begin);
+      });
+
+   ranks_.upload(ranks);
+   ranks_.copy(ranks);
+
+   // the boxes are known once all chunks are extracted
+   boxBuffer_.upload(boxes_);
+}
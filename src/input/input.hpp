@@ -38,10 +38,15 @@ public:
       return &(centers_[3*rank]);
    }
 
+   /// Normalization coefficients (0,1,2=domain, 3=solution).
+   double normScale(int i) const { return scale_[i]; }
+   double normOffset(int i) const { return offset_[i]; }
+
 protected:
    int numRanks_, order_;
    const double *nodes1d_;
    double min_[4], max_[4];
+   double scale_[4], offset_[4];
    std::vector<double> centers_;
 };
 
@@ -57,12 +62,30 @@ protected:
 class SurfaceCoefs
 {
 public:
-   SurfaceCoefs() : nf_(0), buffer_(GL_STATIC_DRAW), ranks_(GL_STATIC_DRAW) {}
+   SurfaceCoefs()
+      : nf_(0), ndof_(0), buffer_(GL_STATIC_DRAW), ranks_(GL_STATIC_DRAW) {}
+
+   /// Determine numFaces() and numDofs(), don't extract anything yet.
+   virtual void prepare(const Solution &solution) = 0;
 
-   virtual void extract(const Solution &solution) = 0;
+   /** Extract the coefficients of faces [begin, end) to host memory only.
+       'coefs' must have room for 4*(end-begin)*numDofs() floats, 'ranks'
+       for (end-begin) ints. prepare() must be called first. Can be called
+       from a different thread than the GL thread. */
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks) = 0;
+
+   /** Extract the coefficients and upload them to the GPU. The default
+       implementation extracts in chunks and uploads each chunk while the
+       next one is being extracted, so that the host only holds two chunks
+       of coefficients at a time. */
+   virtual void extract(const Solution &solution);
 
    int numFaces() const { return nf_; }
 
+   /// Return the number of DOFs (vec4 coefficients) per face.
+   int numDofs() const { return ndof_; }
+
    const Buffer& buffer() const { return buffer_; }
 
    /// Return buffer containing face ranks (format int[numFaces]).
@@ -71,7 +94,7 @@ public:
    virtual ~SurfaceCoefs() {}
 
 protected:
-   int nf_;
+   int nf_, ndof_;
    Buffer buffer_, ranks_;
 };
 
@@ -107,12 +130,31 @@ struct BBox
 class VolumeCoefs
 {
 public:
-   VolumeCoefs() : ne_(0), buffer_(GL_STATIC_DRAW), ranks_(GL_STATIC_DRAW) {}
-
-   virtual void extract(const Solution &solution) = 0;
+   VolumeCoefs()
+      : ne_(0), ndof_(0), buffer_(GL_STATIC_DRAW), ranks_(GL_STATIC_DRAW)
+      , boxBuffer_(GL_STATIC_DRAW) {}
+
+   /** Determine numElements() and numDofs(), don't extract anything yet.
+       Allocates the bounding boxes. */
+   virtual void prepare(const Solution &solution) = 0;
+
+   /** Extract the coefficients and bounding boxes of elements [begin, end)
+       to host memory only. 'coefs' must have room for 4*(end-begin)*
+       numDofs() floats, 'ranks' for (end-begin) ints. prepare() must be
+       called first. Can be called from a different thread than the GL
+       thread. */
+   virtual void extractHost(const Solution &solution, long begin, long end,
+                            float *coefs, int *ranks) = 0;
+
+   /** Extract the coefficients and upload them to the GPU, in chunks
+       (see SurfaceCoefs::extract). */
+   virtual void extract(const Solution &solution);
 
    int numElements() const { return ne_; }
 
+   /// Return the number of DOFs (vec4 coefficients) per element.
+   int numDofs() const { return ndof_; }
+
    const Buffer& buffer() const { return buffer_; }
 
    /// Return buffer containing element ranks (format int[numElements]).
@@ -121,11 +163,14 @@ public:
    /// Return approximate element bounding box (for speeding up mesh cutting)
    const BBox<float>& boundingBox(int i) const { return boxes_[i]; }
 
+   /// Return GPU copy of the bounding boxes (format float[numElements][6]).
+   const Buffer& elemBoxes() const { return boxBuffer_; }
+
    virtual ~VolumeCoefs() {}
 
 protected:
-   int ne_;
-   Buffer buffer_, ranks_;
+   int ne_, ndof_;
+   Buffer buffer_, ranks_, boxBuffer_;
    std::vector<BBox<float>> boxes_;
 };
 
@@ -1,12 +1,17 @@
 #include <fstream>
+#include <cstdio>
 
 #include <QApplication>
 
 #include "main.hpp"
 #include "render.hpp"
+#include "headless.hpp"
+#include "batch.hpp"
+#include "profiler.hpp"
 #include "utility.hpp"
 
 #include "input/input-mfem.hpp"
+#include "input/input-cache.hpp"
 
 #include "3rdparty/argagg.hpp"
 
@@ -32,7 +37,46 @@ int main(int argc, char *argv[])
          "Solution (GridFunction) file to visualize.", 1},
 
       { "np", {"-n", "--num-proc"},
-         "Load mesh/solution from multiple processors.", 1}
+         "Load mesh/solution from multiple processors.", 1},
+
+      { "threads", {"-t", "--threads"},
+         "Number of threads for loading (default: all cores).", 1},
+
+      { "cache", {"-c", "--cache"},
+         "Use a binary coefficient cache (<mesh>.hogcache), "
+         "create it if missing or outdated.", 0},
+
+      { "voxels", {"-v", "--voxel-cache"},
+         "GPU memory budget for cached cut plane voxels, in MB "
+         "(default: 256).", 1},
+
+      { "headless", {"--headless"},
+         "Render one image offscreen (EGL) and exit, no window.", 0},
+
+      { "output", {"-o", "--output"},
+         "Headless output image (default: hogtess.png, or frame%04d.png "
+         "with --batch).", 1},
+
+      { "size", {"--size"},
+         "Headless image size WxH (default: 1200x1000).", 1},
+
+      { "view", {"--view"},
+         "Headless view: rotateX,rotateY,zoom (default: 0,0,0).", 1},
+
+      { "clip", {"--clip"},
+         "Headless clip plane: mode,x,y,z (mode 0 = off, "
+         "1 = marching cubes, 2 = direct, 3 = CPU marching cubes).", 1},
+
+      { "level", {"--level"},
+         "Headless tesselation level (default: 8).", 1},
+
+      { "batch", {"-b", "--batch"},
+         "Render all frames of a job file headless and exit (see "
+         "batch.hpp). --view, --clip, --level and -o are the defaults "
+         "of its first line.", 1},
+
+      { "trace", {"--trace"},
+         "Profile the run and write a Chrome trace (JSON) to this file.", 1}
    }};
 
    argagg::parser_results args;
@@ -62,6 +106,17 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
    }
 
+   if (args["threads"])
+   {
+      setNumThreads(args["threads"].as<int>(0));
+   }
+
+   std::string tracePath = args["trace"].as<std::string>("");
+   if (!tracePath.empty())
+   {
+      Profiler::enable(true);
+   }
+
    std::string argMesh = args["mesh"].as<std::string>("");
    std::string argGF = args["gf"].as<std::string>("");
 
@@ -82,9 +137,145 @@ int main(int argc, char *argv[])
       gfPaths = {argGF};
    }
 
-   MFEMSolution solution(meshPaths, gfPaths);
-   MFEMSurfaceCoefs surfaceCoefs;
-   MFEMVolumeCoefs volumeCoefs;
+   std::unique_ptr<Solution> solution;
+   std::unique_ptr<SurfaceCoefs> surfaceCoefs;
+   std::unique_ptr<VolumeCoefs> volumeCoefs;
+
+   std::string cachePath = argMesh + ".hogcache";
+
+   // the cache is only used if it was made from exactly these input files
+   std::vector<std::string> inputPaths(meshPaths);
+   inputPaths.insert(inputPaths.end(), gfPaths.begin(), gfPaths.end());
+   std::string signature = CacheFile::inputSignature(inputPaths);
+
+   auto openCache = [&]() -> bool
+   {
+      try
+      {
+         std::shared_ptr<const CacheFile> cache(new CacheFile(cachePath));
+         if (!cache->matches(signature, meshPaths.size()))
+         {
+            std::cout << "Cache " << cachePath << " is outdated." << std::endl;
+            return false;
+         }
+         solution.reset(new CachedSolution(cache));
+         surfaceCoefs.reset(new CachedSurfaceCoefs(cache));
+         volumeCoefs.reset(new CachedVolumeCoefs(cache));
+         std::cout << "Using cache " << cachePath << std::endl;
+         return true;
+      }
+      catch (const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+         return false;
+      }
+   };
+
+   if (!args["cache"] || !std::ifstream(cachePath) || !openCache())
+   {
+      {
+         PROFILE_ZONE("load");
+         solution.reset(new MFEMSolution(meshPaths, gfPaths));
+      }
+      surfaceCoefs.reset(new MFEMSurfaceCoefs);
+      volumeCoefs.reset(new MFEMVolumeCoefs);
+
+      if (args["cache"] && !signature.empty())
+      {
+         try
+         {
+            PROFILE_ZONE("write cache");
+            CacheFile::write(cachePath, signature, *solution,
+                             *surfaceCoefs, *volumeCoefs);
+            // continue with the cache, the MFEM data is no longer needed
+            openCache();
+         }
+         catch (const std::exception &e)
+         {
+            std::cerr << e.what() << std::endl;
+         }
+      }
+   }
+
+   if (args["headless"] || args["batch"])
+   {
+      int width = 1200, height = 1000;
+      FrameParams params;
+
+      std::string str = args["size"].as<std::string>("1200x1000");
+      if (std::sscanf(str.c_str(), "%dx%d", &width, &height) != 2 ||
+          width <= 0 || height <= 0)
+      {
+         std::cerr << "Invalid --size " << str << std::endl;
+         return EXIT_FAILURE;
+      }
+      if (args["view"])
+      {
+         str = args["view"].as<std::string>("");
+         if (std::sscanf(str.c_str(), "%lf,%lf,%lf", &params.rotateX,
+                         &params.rotateY, &params.zoom) != 3)
+         {
+            std::cerr << "Invalid --view " << str << std::endl;
+            return EXIT_FAILURE;
+         }
+      }
+      if (args["clip"])
+      {
+         str = args["clip"].as<std::string>("");
+         if (std::sscanf(str.c_str(), "%d,%lf,%lf,%lf", &params.clipMode,
+                         &params.clipX, &params.clipY, &params.clipZ) != 4)
+         {
+            std::cerr << "Invalid --clip " << str << std::endl;
+            return EXIT_FAILURE;
+         }
+      }
+      params.tessLevel = args["level"].as<int>(8);
+
+      try
+      {
+         params.validate();
+
+         // check the job file before creating the context
+         std::vector<BatchFrame> frames;
+         if (args["batch"])
+         {
+            BatchFrame defaults;
+            defaults.params = params;
+            defaults.output = args["output"].as<std::string>("frame%04d.png");
+            frames = parseBatchJob(args["batch"].as<std::string>(""),
+                                   defaults);
+         }
+
+         HeadlessRenderer renderer(*solution, *surfaceCoefs, *volumeCoefs,
+                                   width, height);
+         if (args["voxels"])
+         {
+            renderer.setVoxelBudget(args["voxels"].as<long>(256) * 1024*1024);
+         }
+         if (args["batch"])
+         {
+            runBatchJob(renderer, frames);
+         }
+         else
+         {
+            Profiler::beginFrame();
+            renderer.render(params);
+            renderer.save(args["output"].as<std::string>("hogtess.png"));
+            Profiler::endFrame();
+         }
+         if (!tracePath.empty())
+         {
+            // GPU timestamps are resolved while the context is still alive
+            Profiler::writeTrace(tracePath);
+         }
+      }
+      catch (const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+         return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+   }
 
    QApplication app(argc, argv);
 
@@ -93,7 +284,12 @@ int main(int argc, char *argv[])
    glf.setSamples(8);
 
    RenderWidget* gl =
-      new RenderWidget(glf, solution, surfaceCoefs, volumeCoefs);
+      new RenderWidget(glf, *solution, *surfaceCoefs, *volumeCoefs);
+
+   if (args["voxels"])
+   {
+      gl->setVoxelBudget(args["voxels"].as<long>(256) * 1024*1024);
+   }
 
    MainWindow wnd(gl);
    gl->setParent(&wnd);
@@ -102,5 +298,19 @@ int main(int argc, char *argv[])
    wnd.resize(size);
    wnd.show();
 
-   return app.exec();
+   int result = app.exec();
+
+   if (!tracePath.empty())
+   {
+      try
+      {
+         gl->makeCurrent();
+         Profiler::writeTrace(tracePath);
+      }
+      catch (const std::exception &e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+   }
+   return result;
 }
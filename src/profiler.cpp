@@ -0,0 +1,375 @@
+#include <iostream>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include <GL/gl.h>
+
+#include "profiler.hpp"
+#include "utility.hpp"
+
+
+namespace
+{
+
+struct Event
+{
+   const char *name;
+   int64_t start, end;
+   int depth, frame;
+};
+
+/// Zones recorded by one thread. Only the owner appends, under 'lock'.
+struct ThreadBuffer
+{
+   std::mutex lock;
+   std::vector<Event> events;
+   int depth = 0;
+};
+
+/// A pair of GL_TIMESTAMP queries around the commands of a GpuZone.
+struct GpuQuery
+{
+   GLuint ids[2];
+   const char *name;
+   int depth, frame;
+   bool ended;
+};
+
+std::atomic<bool> recording(false);
+std::atomic<int> currentFrame(0);
+bool tracing = false;
+
+// all thread buffers, in order of first use (trace thread ids 1, 2, ...)
+std::mutex registryLock;
+std::vector<std::unique_ptr<ThreadBuffer>> threads;
+
+// GPU zones as events on their own track (GL thread only)
+ThreadBuffer gpuBuffer;
+std::deque<GpuQuery> gpuPending;
+int gpuFirstId = 0; // id of gpuPending.front()
+std::vector<GLuint> freeQueries;
+int64_t gpuOffset = 0; // GPU timestamp - now()
+bool gpuCalibrated = false;
+
+int summaryFrame = -1;
+std::vector<std::string> summary;
+
+
+ThreadBuffer& threadBuffer()
+{
+   thread_local ThreadBuffer *buffer = nullptr;
+   if (!buffer)
+   {
+      std::lock_guard<std::mutex> guard(registryLock);
+      threads.emplace_back(new ThreadBuffer);
+      buffer = threads.back().get();
+   }
+   return *buffer;
+}
+
+
+/// Move the finished GPU queries to gpuBuffer, in order.
+void resolveGpu(bool wait)
+{
+   while (!gpuPending.empty())
+   {
+      GpuQuery &q = gpuPending.front();
+      if (!q.ended) { break; }
+
+      if (!wait)
+      {
+         GLint available = 0;
+         glGetQueryObjectiv(q.ids[1], GL_QUERY_RESULT_AVAILABLE, &available);
+         if (!available) { break; }
+      }
+
+      GLuint64 t0, t1;
+      glGetQueryObjectui64v(q.ids[0], GL_QUERY_RESULT, &t0);
+      glGetQueryObjectui64v(q.ids[1], GL_QUERY_RESULT, &t1);
+
+      {
+         std::lock_guard<std::mutex> guard(gpuBuffer.lock);
+         gpuBuffer.events.push_back({q.name, int64_t(t0) - gpuOffset,
+                                     int64_t(t1) - gpuOffset,
+                                     q.depth, q.frame});
+      }
+
+      freeQueries.push_back(q.ids[0]);
+      freeQueries.push_back(q.ids[1]);
+      gpuPending.pop_front();
+      gpuFirstId++;
+   }
+}
+
+
+/// Aggregate the zones of 'frame' by name and nesting level.
+std::vector<std::string> summarize(int frame)
+{
+   struct Line
+   {
+      const char *name;
+      int depth, count;
+      int64_t first;
+      double cpu, gpu;
+   };
+   std::vector<Line> lines;
+   std::map<std::pair<const char*, int>, int> index;
+
+   auto add = [&](const Event &e, bool gpu)
+   {
+      auto key = std::make_pair(e.name, e.depth);
+      auto it = index.find(key);
+      if (it == index.end())
+      {
+         it = index.insert({key, int(lines.size())}).first;
+         lines.push_back({e.name, e.depth, 0, e.start, 0.0, 0.0});
+      }
+      Line &line = lines[it->second];
+      double ms = (e.end - e.start) * 1e-6;
+      if (gpu) {
+         line.gpu += ms;
+      }
+      else {
+         line.cpu += ms;
+         line.count++;
+         line.first = std::min(line.first, e.start);
+      }
+   };
+
+   for (auto &t : threads)
+   {
+      std::lock_guard<std::mutex> guard(t->lock);
+      for (const Event &e : t->events) {
+         if (e.frame == frame) { add(e, false); }
+      }
+   }
+   {
+      std::lock_guard<std::mutex> guard(gpuBuffer.lock);
+      for (const Event &e : gpuBuffer.events) {
+         if (e.frame == frame) { add(e, true); }
+      }
+   }
+
+   std::stable_sort(lines.begin(), lines.end(),
+                    [](const Line &a, const Line &b)
+                    { return a.first < b.first; });
+
+   std::vector<std::string> result;
+   for (const Line &line : lines)
+   {
+      std::string str = format_str("%*s%s: %.2f ms", 2*line.depth, "",
+                                   line.name, line.cpu);
+      if (line.gpu > 0) {
+         str += format_str(", GPU %.2f ms", line.gpu);
+      }
+      if (line.count > 1) {
+         str += format_str(" (%dx)", line.count);
+      }
+      result.push_back(str);
+   }
+   return result;
+}
+
+
+/// Forget the events of frames up to 'frame' (when not tracing).
+void discard(ThreadBuffer &buffer, int frame)
+{
+   std::lock_guard<std::mutex> guard(buffer.lock);
+   auto &ev = buffer.events;
+   ev.erase(std::remove_if(ev.begin(), ev.end(),
+                           [frame](const Event &e) { return e.frame <= frame; }),
+            ev.end());
+}
+
+
+std::string jsonString(const char *str)
+{
+   std::string result("\"");
+   for (; *str; str++)
+   {
+      if (*str == '"' || *str == '\\') { result += '\\'; }
+      result += *str;
+   }
+   return result + "\"";
+}
+
+} // namespace
+
+
+int64_t Profiler::now()
+{
+   static const auto epoch = std::chrono::steady_clock::now();
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+}
+
+
+void Profiler::enable(bool trace)
+{
+   tracing = tracing || trace;
+   recording = true;
+}
+
+void Profiler::disable()
+{
+   recording = false;
+}
+
+bool Profiler::enabled()
+{
+   return recording;
+}
+
+
+void Profiler::beginFrame()
+{
+   currentFrame++;
+}
+
+
+void Profiler::endFrame()
+{
+   if (!recording) { return; }
+
+   resolveGpu(false);
+
+   // the frame before the oldest pending query is complete
+   int complete = gpuPending.empty() ? int(currentFrame)
+                                     : gpuPending.front().frame - 1;
+   if (complete <= summaryFrame) { return; }
+
+   std::lock_guard<std::mutex> guard(registryLock);
+   summary = summarize(complete);
+   summaryFrame = complete;
+
+   if (!tracing)
+   {
+      for (auto &t : threads) {
+         discard(*t, complete);
+      }
+      discard(gpuBuffer, complete);
+   }
+}
+
+
+std::vector<std::string> Profiler::frameSummary()
+{
+   std::lock_guard<std::mutex> guard(registryLock);
+   return summary;
+}
+
+
+void Profiler::writeTrace(const std::string &path)
+{
+   resolveGpu(true);
+
+   FILE *f = std::fopen(path.c_str(), "w");
+   if (!f) {
+      throw std::runtime_error("Cannot write trace " + path);
+   }
+
+   std::fprintf(f, "{\"traceEvents\":[\n");
+   std::fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                   "\"tid\":0,\"args\":{\"name\":\"GPU\"}}");
+
+   auto write = [f](const Event &e, int tid, const char *cat)
+   {
+      std::fprintf(f, ",\n{\"name\":%s,\"cat\":\"%s\",\"ph\":\"X\","
+                      "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                      "\"args\":{\"frame\":%d}}",
+                   jsonString(e.name).c_str(), cat, e.start * 1e-3,
+                   (e.end - e.start) * 1e-3, tid, e.frame);
+   };
+
+   std::lock_guard<std::mutex> guard(registryLock);
+
+   for (int i = 0; i < int(threads.size()); i++)
+   {
+      std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", i+1, i);
+
+      std::lock_guard<std::mutex> tguard(threads[i]->lock);
+      for (const Event &e : threads[i]->events) {
+         write(e, i+1, "cpu");
+      }
+   }
+   {
+      std::lock_guard<std::mutex> tguard(gpuBuffer.lock);
+      for (const Event &e : gpuBuffer.events) {
+         write(e, 0, "gpu");
+      }
+   }
+
+   std::fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+   if (std::fclose(f) != 0) {
+      throw std::runtime_error("Cannot write trace " + path);
+   }
+   std::cout << "Wrote trace " << path << std::endl;
+}
+
+
+int Profiler::beginZone()
+{
+   return threadBuffer().depth++;
+}
+
+
+void Profiler::endZone(const char *name, int64_t start, int depth)
+{
+   ThreadBuffer &buffer = threadBuffer();
+   buffer.depth = depth;
+
+   Event e = { name, start, now(), depth, currentFrame };
+   std::lock_guard<std::mutex> guard(buffer.lock);
+   buffer.events.push_back(e);
+}
+
+
+int Profiler::beginGpuZone()
+{
+   if (!gpuCalibrated)
+   {
+      GLint64 gpuNow;
+      glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+      gpuOffset = gpuNow - now();
+      gpuCalibrated = true;
+   }
+
+   if (freeQueries.size() < 2)
+   {
+      GLuint ids[16];
+      glGenQueries(16, ids);
+      freeQueries.insert(freeQueries.end(), ids, ids + 16);
+   }
+
+   GpuQuery q;
+   q.ids[1] = freeQueries.back(); freeQueries.pop_back();
+   q.ids[0] = freeQueries.back(); freeQueries.pop_back();
+   q.name = nullptr;
+   q.depth = 0;
+   q.frame = currentFrame;
+   q.ended = false;
+
+   glQueryCounter(q.ids[0], GL_TIMESTAMP);
+   gpuPending.push_back(q);
+
+   return gpuFirstId + gpuPending.size() - 1;
+}
+
+
+void Profiler::endGpuZone(int query, const char *name, int depth)
+{
+   GpuQuery &q = gpuPending[query - gpuFirstId];
+   glQueryCounter(q.ids[1], GL_TIMESTAMP);
+   q.name = name;
+   q.depth = depth;
+   q.ended = true;
+}
@@ -0,0 +1,118 @@
+#ifndef hogtess_profiler_hpp_included_
+#define hogtess_profiler_hpp_included_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+/** Hierarchical profiler. Code is instrumented with scoped zones:
+ *
+ *     PROFILE_ZONE("tesselate");       // CPU time of the enclosing scope
+ *     GPU_ZONE("march");               // CPU time + GL_TIMESTAMP queries
+ *
+ *  Zones nest, each thread records to its own buffer. GPU zones may only be
+ *  used on the GL thread, their queries are read back without stalling, a
+ *  few frames later. Nothing is recorded until the profiler is enabled.
+ *
+ *  The recorded zones can be written as a Chrome trace (chrome://tracing,
+ *  Perfetto) and summarized per frame (beginFrame()/endFrame()), e.g. for
+ *  an on-screen overlay. Zone names must be string literals.
+ */
+class Profiler
+{
+public:
+   /** Start recording. With 'trace', all zones are kept for writeTrace(),
+       otherwise only those of the frames not yet summarized. */
+   static void enable(bool trace = false);
+
+   /// Stop recording (the recorded trace is kept).
+   static void disable();
+
+   static bool enabled();
+
+   /// Mark the start of a frame, zones are attributed to the current frame.
+   static void beginFrame();
+
+   /** Mark the end of a frame, collect the GPU queries that are done and
+       update the summary of the newest frame that is complete. */
+   static void endFrame();
+
+   /** Summary of the last complete frame: one line per zone (in order,
+       indented by nesting), with CPU and GPU milliseconds. */
+   static std::vector<std::string> frameSummary();
+
+   /** Write all recorded zones as Chrome trace event JSON. Waits for the
+       pending GPU queries. Throws std::runtime_error on I/O errors. */
+   static void writeTrace(const std::string &path);
+
+   /// Time in nanoseconds since the profiler was first used.
+   static int64_t now();
+
+   // used by the zones
+   static int beginZone();
+   static void endZone(const char *name, int64_t start, int depth);
+   static int beginGpuZone();
+   static void endGpuZone(int query, const char *name, int depth);
+};
+
+
+/// Records the time of its scope as a CPU zone.
+class ProfileZone
+{
+public:
+   explicit ProfileZone(const char *name)
+      : name(name), start(Profiler::now())
+      , depth(Profiler::enabled() ? Profiler::beginZone() : -1)
+   {}
+
+   ~ProfileZone()
+   {
+      if (depth >= 0) {
+         Profiler::endZone(name, start, depth);
+      }
+   }
+
+   /// Seconds since the start of the zone, also when not recording.
+   double elapsed() const { return (Profiler::now() - start) * 1e-9; }
+
+protected:
+   const char *name;
+   int64_t start;
+   int depth;
+};
+
+
+/** A CPU zone that also measures the GL commands issued in its scope, with
+ *  a pair of GL_TIMESTAMP queries. GL thread only. */
+class GpuZone : public ProfileZone
+{
+public:
+   explicit GpuZone(const char *name)
+      : ProfileZone(name)
+      , query(depth >= 0 ? Profiler::beginGpuZone() : -1)
+   {}
+
+   ~GpuZone()
+   {
+      if (query >= 0) {
+         Profiler::endGpuZone(query, name, depth);
+      }
+   }
+
+protected:
+   int query;
+};
+
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_ZONE(name) \
+   ProfileZone PROFILE_CONCAT(profileZone_, __LINE__)(name)
+
+#define GPU_ZONE(name) \
+   GpuZone PROFILE_CONCAT(gpuZone_, __LINE__)(name)
+
+
+#endif // hogtess_profiler_hpp_included_
@@ -3,14 +3,17 @@
 #include <cstdlib>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 
 #include <QString>
 
 #include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
 
 #include "render.hpp"
+#include "view.hpp"
 #include "utility.hpp"
+#include "profiler.hpp"
+#include "shape/shape.hpp"
 
 
 RenderWidget::RenderWidget(const QGLFormat &format,
@@ -32,42 +35,40 @@ RenderWidget::RenderWidget(const QGLFormat &format,
    , panX(0.), panY(0.)
 
    , tessLevel(8)
+   , meshLevel(0)
    , wireframe(false)
    , lines(true)
 
+   , progressive(true)
+   , interacting(false)
+   , cutDirty(false)
+
    , clipMode(0)
    , clipX(0), clipY(0), clipZ(0)
    , clipPlane(1, 0, 0, 0)
 
    , explode(0)
+   , showProfile(false)
 {
    grabKeyboard();
+
+   refineTimer.setSingleShot(true);
+   refineTimer.setInterval(300);
+   connect(&refineTimer, SIGNAL(timeout()), this, SLOT(refine()));
+
+   pendingTimer.setSingleShot(true);
+   pendingTimer.setInterval(10);
+   connect(&pendingTimer, SIGNAL(timeout()), this, SLOT(checkPending()));
 }
 
 
 void RenderWidget::initializeGL()
 {
-   std::cout << "OpenGL version: " << glGetString(GL_VERSION)
-             << ", renderer: " << glGetString(GL_RENDERER) << std::endl;
-
-   GLint major, minor;
-   glGetIntegerv(GL_MAJOR_VERSION, &major);
-   glGetIntegerv(GL_MINOR_VERSION, &minor);
-
-   if ((10*major + minor) < 43)
-   {
-      throw std::runtime_error(
-         "OpenGL version 4.3 or higher is required to run this program.");
-   }
+   initializeRenderState();
 
    surfaceMesh.initializeGL(solution.order());
    cutPlaneMesh.initializeGL(solution.order());
 
-   glEnable(GL_DEPTH_TEST);
-   glDepthFunc(GL_LEQUAL);
-   glEnable(GL_CULL_FACE);
-   glEnable(GL_MULTISAMPLE);
-
    updateSurfMesh();
    updatePartMatrices();
 }
@@ -79,8 +80,9 @@ void RenderWidget::updateSurfMesh()
    {
       surfaceCoefs.extract(solution);
    }
-   std::cout << "Tesselation level " << tessLevel << std::endl;
-   surfaceMesh.tesselate(tessLevel);
+   meshLevel = currentLevel();
+   std::cout << "Tesselation level " << meshLevel << std::endl;
+   surfaceMesh.tesselate(meshLevel);
 
    updateCutMesh();
 }
@@ -88,27 +90,31 @@ void RenderWidget::updateSurfMesh()
 
 void RenderWidget::updateClipPlane()
 {
-   const double speed = 2;
-   double phi = speed*clipY*M_PI/180;
-   double theta = speed*clipX*M_PI/180;
-
-   clipPlane.x = cos(phi)*cos(theta);
-   clipPlane.y = sin(phi);
-   clipPlane.z = -sin(theta);
-   clipPlane.w = -0.005 * clipZ + 1e-6;
+   clipPlane = clipPlaneEquation(clipX, clipY, clipZ);
 }
 
 
 void RenderWidget::updateCutMesh()
 {
-   if (clipMode == 1)
+   // computed in paintGL, at most once per frame
+   cutDirty = true;
+}
+
+
+void RenderWidget::computeCutMesh()
+{
+   cutDirty = false;
+
+   if (clipMode != 0)
    {
       if (!volumeCoefs.numElements())
       {
          volumeCoefs.extract(solution);
       }
       updateClipPlane();
-      cutPlaneMesh.compute(clipPlane, bufPartMat, tessLevel);
+      cutPlaneMesh.setDirect(clipMode == 2);
+      cutPlaneMesh.setCpu(clipMode == 3);
+      cutPlaneMesh.compute(clipPlane, bufPartMat, currentLevel());
    }
    else if (clipMode == 0)
    {
@@ -117,20 +123,56 @@ void RenderWidget::updateCutMesh()
 }
 
 
-void RenderWidget::updatePartMatrices()
+int RenderWidget::currentLevel() const
 {
-   double scale = std::pow(0.93, explode);
+   // half the level (a multiple of 2) while the view is being changed
+   return interacting ? std::max(2, tessLevel/4*2) : tessLevel;
+}
+
 
-   std::vector<glm::mat4> matrices(solution.numRanks());
-   for (int rank = 0; rank < matrices.size(); rank++)
+void RenderWidget::interact()
+{
+   if (!progressive) { return; }
+
+   refineTimer.start(); // (re)start the idle period
+
+   if (!interacting)
    {
-      const double *center = solution.partCenter(rank);
-      glm::dmat4 mat(1.0);
-      mat = glm::translate(mat, glm::dvec3(center[0], center[1], center[2]));
-      mat = glm::scale(mat, glm::dvec3(scale, scale, scale));
-      mat = glm::translate(mat, glm::dvec3(-center[0], -center[1], -center[2]));
-      matrices[rank] = mat;
+      interacting = true;
+      if (currentLevel() != meshLevel) {
+         updateSurfMesh();
+      }
    }
+}
+
+
+void RenderWidget::refine()
+{
+   interacting = false;
+   makeCurrent();
+
+   if (meshLevel != tessLevel) {
+      updateSurfMesh(); // also recomputes the cut plane
+      requestRedraw();
+   }
+}
+
+
+void RenderWidget::checkPending()
+{
+   makeCurrent();
+   if (cutPlaneMesh.poll()) {
+      requestRedraw();
+   }
+   else if (cutPlaneMesh.pending()) {
+      pendingTimer.start();
+   }
+}
+
+
+void RenderWidget::updatePartMatrices()
+{
+   std::vector<glm::mat4> matrices = partMatrices(solution, explode);
 
    bufPartMat.upload(matrices);
    bufPartMat.copy(matrices);
@@ -147,27 +189,32 @@ void RenderWidget::resizeGL(int width, int height)
 
 void RenderWidget::paintGL()
 {
+   Profiler::beginFrame();
+   drawScene();
+
+   if (showProfile) {
+      drawProfile();
+   }
+   Profiler::endFrame();
+}
+
+
+void RenderWidget::drawScene()
+{
+   PROFILE_ZONE("frame");
+
+   if (cutDirty) {
+      computeCutMesh();
+   }
+
    glClearColor(1, 1, 1, 1);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
 
-   // set up the projection matrix
-   glm::dmat4 proj = glm::perspective(glm::radians(30.0), aspect, 0.001, 10.0);
-
-   // set up the model view matrix
-   double scale = std::exp(zoom);
-   glm::dmat4 view(1.0);
-   view = glm::translate(view, glm::dvec3(0, 0, -2));
-   view = glm::scale(view, glm::dvec3(scale, scale, scale));
-   view = glm::rotate(view, glm::radians(rotateX), glm::dvec3(1, 0, 0));
-   view = glm::rotate(view, glm::radians(rotateY), glm::dvec3(0, 1, 0));
-   view = glm::rotate(view, glm::radians(-90.0), glm::dvec3(1, 0, 0));
-
-   // final transformation matrix, round to floats
-   glm::mat4 mvp = proj*view;
+   glm::mat4 mvp = viewMatrix(aspect, rotateX, rotateY, zoom);
 
    // draw tesselated surface
-   if (clipMode == 1) {
+   if (clipMode != 0) {
       updateClipPlane();
       glEnable(GL_CLIP_DISTANCE0);
    }
@@ -178,10 +225,32 @@ void RenderWidget::paintGL()
 
    // draw cut plane
    glDisable(GL_CLIP_DISTANCE0);
-   if (clipMode == 1)
+   if (clipMode != 0)
    {
       cutPlaneMesh.draw(mvp, lines);
+
+      // check the cut plane buffers again soon, without redrawing
+      if (cutPlaneMesh.pending()) {
+         pendingTimer.start();
+      }
+   }
+}
+
+
+void RenderWidget::drawProfile()
+{
+   // the summary is of the last frame whose GPU times are known
+   std::vector<std::string> lines = Profiler::frameSummary();
+
+   glUseProgram(0);
+   glDisable(GL_DEPTH_TEST);
+   glColor3f(0, 0, 0);
+
+   for (int i = 0; i < int(lines.size()); i++) {
+      renderText(10, 20 + 15*i, QString::fromStdString(lines[i]));
    }
+
+   glEnable(GL_DEPTH_TEST);
 }
 
 
@@ -198,7 +267,14 @@ void RenderWidget::mouseMoveEvent(QMouseEvent *event)
 
     bool leftButton();
     bool rightButton(event->buttons() & Qt::RightButton);
-    bool clip(clipMode == 1 && (event->modifiers() & Qt::ShiftModifier));
+    bool clip(clipMode != 0 && (event->modifiers() & Qt::ShiftModifier));
+
+    if (!(event->buttons() & (Qt::LeftButton | Qt::RightButton |
+                              Qt::MiddleButton)))
+    {
+       return; // nothing changes
+    }
+    interact();
 
     if (event->buttons() & Qt::LeftButton)
     {
@@ -237,7 +313,7 @@ void RenderWidget::mouseMoveEvent(QMouseEvent *event)
     }
 
     lastPos = event->pos();
-    updateGL();
+    requestRedraw();
 }
 
 
@@ -245,13 +321,15 @@ void RenderWidget::wheelEvent(QWheelEvent *event)
 {
    const double speed = 0.1;
    zoom += speed * event->delta() / 120.0;
-   updateGL();
+   interact();
+   requestRedraw();
 }
 
 
 void RenderWidget::keyPressEvent(QKeyEvent * event)
 {
    int dir = (event->modifiers() & Qt::ShiftModifier) ? -1 : 1;
+   bool changed = true;
 
    switch (event->key())
    {
@@ -260,9 +338,15 @@ void RenderWidget::keyPressEvent(QKeyEvent * event)
          break;
 
       case Qt::Key_Left:
+      case Qt::Key_Right:
+         changed = false;
          break;
 
-      case Qt::Key_Right:
+      case Qt::Key_P:
+         progressive = !progressive;
+         std::cout << "Progressive refinement "
+                   << (progressive ? "on." : "off.") << std::endl;
+         changed = false;
          break;
 
       case Qt::Key_Minus:
@@ -271,12 +355,44 @@ void RenderWidget::keyPressEvent(QKeyEvent * event)
          break;
 
       case Qt::Key_Plus:
-         tessLevel += 2;
+         if (tessLevel + 2 <= MaxTessLevel) { tessLevel += 2; }
+         updateSurfMesh();
+         break;
+
+      case Qt::Key_L:
+         surfaceMesh.setViewLod(!surfaceMesh.getViewLod());
+         std::cout << "View dependent tesselation "
+                   << (surfaceMesh.getViewLod() ? "on." : "off.")
+                   << std::endl;
+         updateSurfMesh();
+         break;
+
+      case Qt::Key_H:
+         surfaceMesh.setHardware(!surfaceMesh.getHardware());
+         std::cout << "Surface tesselated by "
+                   << (surfaceMesh.getHardware() ? "tesselation shaders."
+                                                 : "compute shader.")
+                   << std::endl;
          updateSurfMesh();
          break;
 
+      case Qt::Key_K:
+         surfaceMesh.setCulling(!surfaceMesh.getCulling());
+         std::cout << "Surface culling "
+                   << (surfaceMesh.getCulling() ? "on." : "off.")
+                   << std::endl;
+         break;
+
+      case Qt::Key_O:
+         surfaceMesh.setOcclusion(!surfaceMesh.getOcclusion());
+         std::cout << "Occlusion culling "
+                   << (surfaceMesh.getOcclusion() ? "on." : "off.")
+                   << std::endl;
+         break;
+
       case Qt::Key_I:
-         clipMode = (clipMode + 1) % 2;
+         // off, marching cubes cut, direct cut, marching cubes on the CPU
+         clipMode = (clipMode + 1) % 4;
          updateCutMesh();
          break;
 
@@ -284,6 +400,14 @@ void RenderWidget::keyPressEvent(QKeyEvent * event)
          lines = !lines;
          break;
 
+      case Qt::Key_A:
+         surfaceMesh.setAdaptive(!surfaceMesh.getAdaptive());
+         std::cout << "Adaptive tesselation "
+                   << (surfaceMesh.getAdaptive() ? "on." : "off.")
+                   << std::endl;
+         updateSurfMesh();
+         break;
+
       case Qt::Key_X:
          clipX += dir;
          updateCutMesh();
@@ -299,17 +423,44 @@ void RenderWidget::keyPressEvent(QKeyEvent * event)
          updateCutMesh();
          break;
 
+      case Qt::Key_G:
+         cutPlaneMesh.setGpuCulling(!cutPlaneMesh.getGpuCulling());
+         std::cout << "Cut plane culling on the "
+                   << (cutPlaneMesh.getGpuCulling() ? "GPU." : "CPU.")
+                   << std::endl;
+         updateCutMesh();
+         break;
+
       case Qt::Key_W:
          wireframe = !wireframe;
          break;
 
+      case Qt::Key_T:
+         showProfile = !showProfile;
+         if (showProfile) {
+            Profiler::enable(); // keeps recording once on
+         }
+         break;
+
+      case Qt::Key_V:
+         makeCurrent();
+         surfaceMesh.verify();
+         changed = false;
+         break;
+
       case Qt::Key_F11:
          if (dir < 0 && !explode) { break; }
          explode += dir;
          updatePartMatrices();
          updateCutMesh();
          break;
+
+      default:
+         changed = false;
+   }
+
+   if (changed) {
+      requestRedraw();
    }
-   updateGL();
 }
 
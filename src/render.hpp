@@ -30,6 +30,16 @@ public:
 
    virtual ~RenderWidget() {}
 
+   /// See CutPlaneMesh::setVoxelBudget.
+   void setVoxelBudget(long bytes) { cutPlaneMesh.setVoxelBudget(bytes); }
+
+protected slots:
+   /// Return to the full tesselation level after interaction stops.
+   void refine();
+
+   /// Check a pending cut plane mesh, redraw if it changed.
+   void checkPending();
+
 protected:
    const Solution &solution;
    SurfaceCoefs &surfaceCoefs;
@@ -43,11 +53,28 @@ protected:
    void updateClipPlane();
    void updateCutMesh();
    void updatePartMatrices();
+   void computeCutMesh();
+
+   /** Schedule a repaint. All state changes go through here, Qt merges the
+       requests, so each changed state is rendered once and an unchanged
+       one not at all (except when the window system asks for it). */
+   void requestRedraw() { update(); }
+
+   /// Called on each view change by the mouse, see 'progressive'.
+   void interact();
+
+   /// Level to tesselate at now: reduced while interacting.
+   int currentLevel() const;
 
    virtual void initializeGL();
    virtual void resizeGL(int width, int height);
    virtual void paintGL();
 
+   void drawScene();
+
+   /// Overlay of the profiler's frame summary (T key).
+   void drawProfile();
+
    virtual void mousePressEvent(QMouseEvent *event);
    virtual void mouseMoveEvent(QMouseEvent *event);
    virtual void wheelEvent(QWheelEvent *event);
@@ -62,13 +89,22 @@ protected:
    double panX, panY;
 
    int tessLevel;
+   int meshLevel; // level the surface is currently tesselated at
    bool wireframe, lines;
 
+   // progressive mode: reduced level while dragging, refined after a pause
+   bool progressive, interacting;
+   QTimer refineTimer, pendingTimer;
+
+   bool cutDirty; // cut plane mesh needs compute, done in paintGL
+
    int clipMode, clipX, clipY, clipZ;
    glm::vec4 clipPlane;
 
    int explode;
    Buffer bufPartMat;
+
+   bool showProfile;
 };
 
 
@@ -1,3 +1,7 @@
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
 #include "shader.hpp"
 #include "shape.hpp"
 
@@ -33,3 +37,107 @@ void lagrangeUniforms(const Program &prog, int p, const double *nodes1d)
    glUniform1fv(prog.uniform("lagrangeWeights"), p1, fweights);
 }
 
+
+
+std::vector<float> lagrangeTable(int p, const double *nodes1d, int level)
+{
+   int p1 = p+1;
+
+   // barycentric weights
+   std::vector<double> weights(p1, 1.0);
+   for (int i = 0; i <= p; i++)
+   {
+      for (int j = 0; j < i; j++)
+      {
+         double xij = nodes1d[i] - nodes1d[j];
+         weights[i] *=  xij;
+         weights[j] *= -xij;
+      }
+   }
+
+   std::vector<float> table((level+1)*p1);
+   std::vector<double> tmp(p1);
+
+   for (int t = 0; t <= level; t++)
+   {
+      double y = double(t) / level;
+      float *row = table.data() + t*p1;
+
+      int node = -1;
+      double sum = 0.0;
+      for (int i = 0; i <= p && node < 0; i++)
+      {
+         double d = y - nodes1d[i];
+         if (d == 0.0) { node = i; break; }
+
+         tmp[i] = 1.0 / (weights[i] * d);
+         sum += tmp[i];
+      }
+
+      for (int i = 0; i <= p; i++)
+      {
+         if (node >= 0) {
+            row[i] = (i == node) ? 1.0f : 0.0f;
+         }
+         else {
+            row[i] = tmp[i] / sum;
+         }
+      }
+   }
+   return table;
+}
+
+
+void bernsteinUniforms(const Program &prog, int p, const double *nodes1d)
+{
+   int p1 = p+1;
+
+   // V(i, k) = B_k(x_i), the values of the Bernstein basis at the nodes
+   std::vector<double> V(p1*p1), T(p1*p1, 0.0);
+   for (int i = 0; i <= p; i++)
+   {
+      double x = nodes1d[i], binom = 1.0;
+      for (int k = 0; k <= p; k++)
+      {
+         V[i*p1 + k] = binom * std::pow(x, k) * std::pow(1.0 - x, p - k);
+         binom = binom * (p - k) / (k + 1);
+      }
+      T[i*p1 + i] = 1.0;
+   }
+
+   // T = inverse(V), Gauss-Jordan elimination with partial pivoting
+   for (int c = 0; c <= p; c++)
+   {
+      int piv = c;
+      for (int r = c+1; r <= p; r++)
+      {
+         if (std::abs(V[r*p1 + c]) > std::abs(V[piv*p1 + c])) { piv = r; }
+      }
+      for (int k = 0; k <= p; k++)
+      {
+         std::swap(V[c*p1 + k], V[piv*p1 + k]);
+         std::swap(T[c*p1 + k], T[piv*p1 + k]);
+      }
+
+      double d = 1.0 / V[c*p1 + c];
+      for (int k = 0; k <= p; k++)
+      {
+         V[c*p1 + k] *= d;
+         T[c*p1 + k] *= d;
+      }
+
+      for (int r = 0; r <= p; r++)
+      {
+         if (r == c) { continue; }
+         double f = V[r*p1 + c];
+         for (int k = 0; k <= p; k++)
+         {
+            V[r*p1 + k] -= f*V[c*p1 + k];
+            T[r*p1 + k] -= f*T[c*p1 + k];
+         }
+      }
+   }
+
+   std::vector<float> fT(T.begin(), T.end());
+   glUniform1fv(prog.uniform("lagrangeToBernstein"), p1*p1, fT.data());
+}
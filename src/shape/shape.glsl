@@ -25,19 +25,26 @@ void lagrangeShape(float y, out float result[P+1])
             result[i] = l;
         }
     }
-    else // O(p) evaluation
+    else // O(p) evaluation, barycentric formula (stable for high orders)
     {
-        float l = 1.0, lk = 1.0;
+        float sum = 0.0;
         for (int i = 0; i <= P; i++)
         {
-            l *= (y - lagrangeNodes[i]);
-            // TODO lk
+            float d = y - lagrangeNodes[i];
+            if (d == 0.0)
+            {
+                // exactly at a node
+                for (int j = 0; j <= P; j++) {
+                    result[j] = (j == i) ? 1.0 : 0.0;
+                }
+                return;
+            }
+            result[i] = lagrangeWeights[i] / d;
+            sum += result[i];
         }
         for (int i = 0; i <= P; i++)
         {
-            result[i] = l * lagrangeWeights[i] / (y - lagrangeNodes[i]);
-            // TODO result[k] = lk * w[i];
+            result[i] /= sum;
         }
     }
 }
-
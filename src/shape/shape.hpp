@@ -1,11 +1,25 @@
 #ifndef hogtess_shape_hpp_included_
 #define hogtess_shape_hpp_included_
 
+#include <vector>
 
 class Program;
 
+/** Maximum tesselation level, the kernels keep shape function tables and
+    partially contracted coefficients of this size in shared memory. */
+const int MaxTessLevel = 32;
+
 // set the uniforms required by shape.glsl
 void lagrangeUniforms(const Program &prog, int p, const double *nodes1d);
 
+/** Evaluate the 1D Lagrange basis at the tesselation points i/level, using
+    the barycentric formula in double precision. Returns the table
+    basis[i*(p+1) + j], i = 0..level, j = 0..p, for upload to an SSBO. */
+std::vector<float> lagrangeTable(int p, const double *nodes1d, int level);
+
+/** Set the uniform 'lagrangeToBernstein', a (p+1)x(p+1) matrix that
+    converts values at the Lagrange nodes to Bernstein coefficients. */
+void bernsteinUniforms(const Program &prog, int p, const double *nodes1d);
+
 
 #endif // hogtess_shape_hpp_included_
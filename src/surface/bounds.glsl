@@ -0,0 +1,136 @@
+#line 2
+
+// Bounding box and normal cone of each tesselated face, one work group per
+// face. The cone covers the normals of all triangles the face can be drawn
+// with (any 3 corners of a grid cell).
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer vertexBuffer
+{
+    vec4 vertices[];
+};
+
+// faces to process
+layout(std430, binding = 1) buffer faceBuffer
+{
+    uint faces[];
+};
+
+layout(std430, binding = 2) buffer offsetBuffer
+{
+    uint faceOffsets[];
+};
+
+layout(std430, binding = 3) buffer levelBuffer
+{
+    uint faceLevels[];
+};
+
+// per face: (min, 0), (max, 0), (cone axis, cos of cone angle)
+layout(std430, binding = 4) buffer boundsBuffer
+{
+    vec4 bounds[];
+};
+
+uniform int numFaces;
+
+shared vec3 sMin[64], sMax[64], sSum[64];
+shared float sCos[64];
+
+vec3 cornerNormal(vec3 du, vec3 dv)
+{
+   // front faces: (a, b, b+1) in makeQuadFaceIndexBuffers winds as dv x du
+   vec3 n = cross(dv, du);
+   float len = length(n);
+   return (len > 0.0) ? n / len : vec3(0.0);
+}
+
+void main()
+{
+   uint tid = gl_LocalInvocationID.x;
+
+   for (uint f = gl_WorkGroupID.x; f < numFaces; f += gl_NumWorkGroups.x)
+   {
+      uint face = faces[f];
+      uint base = faceOffsets[face];
+      uint level = faceLevels[face];
+      uint level1 = level + 1;
+
+      vec3 bmin = vec3(1e30), bmax = vec3(-1e30), sum = vec3(0.0);
+
+      for (uint n = tid; n < level1*level1; n += 64)
+      {
+         vec3 p = vertices[base + n].xyz;
+         bmin = min(bmin, p);
+         bmax = max(bmax, p);
+      }
+      for (uint n = tid; n < level*level; n += 64)
+      {
+         uint x = n % level, y = n / level;
+         uint a = base + y*level1 + x, b = a + level1;
+
+         vec3 p00 = vertices[a].xyz, p10 = vertices[a+1].xyz;
+         vec3 p01 = vertices[b].xyz, p11 = vertices[b+1].xyz;
+
+         sum += cornerNormal(p10 - p00, p01 - p00) +
+                cornerNormal(p10 - p00, p11 - p10) +
+                cornerNormal(p11 - p01, p01 - p00) +
+                cornerNormal(p11 - p01, p11 - p10);
+      }
+
+      sMin[tid] = bmin;
+      sMax[tid] = bmax;
+      sSum[tid] = sum;
+      barrier();
+
+      for (uint s = 32; s > 0; s >>= 1)
+      {
+         if (tid < s)
+         {
+            sMin[tid] = min(sMin[tid], sMin[tid + s]);
+            sMax[tid] = max(sMax[tid], sMax[tid + s]);
+            sSum[tid] += sSum[tid + s];
+         }
+         barrier();
+      }
+
+      float len = length(sSum[0]);
+      vec3 axis = (len > 0.0) ? sSum[0] / len : vec3(0.0, 0.0, 1.0);
+
+      // cone angle: the largest deviation from the axis
+      float minCos = 1.0;
+      for (uint n = tid; n < level*level; n += 64)
+      {
+         uint x = n % level, y = n / level;
+         uint a = base + y*level1 + x, b = a + level1;
+
+         vec3 p00 = vertices[a].xyz, p10 = vertices[a+1].xyz;
+         vec3 p01 = vertices[b].xyz, p11 = vertices[b+1].xyz;
+
+         minCos = min(minCos, dot(axis, cornerNormal(p10 - p00, p01 - p00)));
+         minCos = min(minCos, dot(axis, cornerNormal(p10 - p00, p11 - p10)));
+         minCos = min(minCos, dot(axis, cornerNormal(p11 - p01, p01 - p00)));
+         minCos = min(minCos, dot(axis, cornerNormal(p11 - p01, p11 - p10)));
+      }
+      sCos[tid] = minCos;
+      barrier();
+
+      for (uint s = 32; s > 0; s >>= 1)
+      {
+         if (tid < s) {
+            sCos[tid] = min(sCos[tid], sCos[tid + s]);
+         }
+         barrier();
+      }
+
+      if (tid == 0)
+      {
+         bounds[3*face + 0] = vec4(sMin[0], 0.0);
+         bounds[3*face + 1] = vec4(sMax[0], 0.0);
+         bounds[3*face + 2] = vec4(axis, (len > 0.0) ? sCos[0] : -1.0);
+      }
+      barrier();
+   }
+}
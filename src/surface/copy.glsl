@@ -0,0 +1,37 @@
+#line 2
+
+// copy runs of vertices of unchanged faces from the previous vertex buffer,
+// one work group per run
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer srcBuffer
+{
+    vec4 srcVertices[];
+};
+
+layout(std430, binding = 1) buffer dstBuffer
+{
+    vec4 dstVertices[];
+};
+
+// (source offset, destination offset, count, 0)
+layout(std430, binding = 2) buffer copyBuffer
+{
+    uvec4 copies[];
+};
+
+uniform int numCopies;
+
+void main()
+{
+   for (uint c = gl_WorkGroupID.x; c < numCopies; c += gl_NumWorkGroups.x)
+   {
+      uvec4 copy = copies[c];
+      for (uint i = gl_LocalInvocationID.x; i < copy.z; i += 64)
+      {
+         dstVertices[copy.y + i] = srcVertices[copy.x + i];
+      }
+   }
+}
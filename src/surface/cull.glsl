@@ -0,0 +1,201 @@
+#line 2
+
+// Per frame culling of the faces against the view frustum, the clip plane
+// and the normal cone. Visible faces are compacted per bucket and counted
+// in the indirect draw commands.
+//
+// With occlusion culling the pass runs twice per frame: phase 1 selects the
+// faces visible in the last frame, phase 2 (after they were drawn and the
+// depth pyramid was built) tests all faces against the pyramid, updates the
+// visibility for the next frame and selects the newly visible faces.
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+// all faces, in bucket order
+layout(std430, binding = 0) buffer bucketBuffer
+{
+    uint bucketFaces[];
+};
+
+layout(std430, binding = 1) buffer boundsBuffer
+{
+    vec4 bounds[];
+};
+
+layout(std430, binding = 2) buffer rankBuffer
+{
+    int faceRank[];
+};
+
+layout(std430, binding = 3) buffer partMatBuffer
+{
+    mat4 matrices[];
+};
+
+// visible faces, bucket k starts at bucketFirst[k]
+layout(std430, binding = 4) buffer visibleBuffer
+{
+    uint visibleFaces[];
+};
+
+// triangle commands for each bucket, then line commands, each being
+// (count, instanceCount, first, baseInstance)
+layout(std430, binding = 5) buffer commandBuffer
+{
+    uint commands[];
+};
+
+// visibility in the last frame, for occlusion culling
+layout(std430, binding = 6) buffer visibilityBuffer
+{
+    uint faceVisible[];
+};
+
+uniform sampler2D hiz;   // depth pyramid
+uniform int hizLevels;
+uniform vec2 viewport;   // size in pixels
+uniform int phase;       // 0 = no occlusion culling, 1, 2
+
+uniform mat4 mvp;
+uniform vec4 clipPlane;
+uniform bool useClipPlane;
+uniform vec3 eye;
+
+uniform int numFaces;
+uniform int numBuckets;
+uniform int bucketFirst[MAX_BUCKETS];
+
+const float PI = 3.14159265;
+
+bool visible(uint face)
+{
+   vec3 bmin = bounds[3*face + 0].xyz;
+   vec3 bmax = bounds[3*face + 1].xyz;
+   vec4 cone = bounds[3*face + 2];
+
+   mat4 part = matrices[faceRank[face]];
+   mat4 m = mvp * part;
+
+   // frustum and clip plane: all corners outside of one plane
+   ivec3 below = ivec3(0), above = ivec3(0);
+   bool allClipped = useClipPlane;
+   for (int i = 0; i < 8; i++)
+   {
+      vec3 corner = vec3((i & 1) != 0 ? bmax.x : bmin.x,
+                         (i & 2) != 0 ? bmax.y : bmin.y,
+                         (i & 4) != 0 ? bmax.z : bmin.z);
+
+      vec4 world = part * vec4(corner, 1.0);
+      vec4 clip = mvp * world;
+
+      below += ivec3(lessThan(clip.xyz, vec3(-clip.w)));
+      above += ivec3(greaterThan(clip.xyz, vec3(clip.w)));
+      allClipped = allClipped && (dot(world, clipPlane) > 0.0);
+   }
+   if (any(equal(below, ivec3(8))) || any(equal(above, ivec3(8))) ||
+       allClipped)
+   {
+      return false;
+   }
+
+   // back faces: all normals of the cone face away from the eye
+   if (cone.w > 0.0)
+   {
+      vec4 center = part * vec4(0.5*(bmin + bmax), 1.0);
+      float radius = 0.5*length(bmax - bmin) * length(part[0].xyz);
+      vec3 axis = normalize(mat3(part) * cone.xyz);
+
+      vec3 d = center.xyz/center.w - eye;
+      float dist = length(d);
+      if (dist > radius)
+      {
+         float angle = acos(clamp(dot(axis, d) / dist, -1.0, 1.0))
+                     + asin(radius / dist) + acos(cone.w);
+         if (angle < 0.5*PI - 1e-3) {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+// test the screen rectangle of the box against the depth pyramid
+bool occluded(uint face)
+{
+   vec3 bmin = bounds[3*face + 0].xyz;
+   vec3 bmax = bounds[3*face + 1].xyz;
+   mat4 m = mvp * matrices[faceRank[face]];
+
+   vec2 lo = vec2(1.0), hi = vec2(-1.0);
+   float zmin = 1.0;
+   for (int i = 0; i < 8; i++)
+   {
+      vec3 corner = vec3((i & 1) != 0 ? bmax.x : bmin.x,
+                         (i & 2) != 0 ? bmax.y : bmin.y,
+                         (i & 4) != 0 ? bmax.z : bmin.z);
+
+      vec4 clip = m * vec4(corner, 1.0);
+      if (clip.w <= 0.0) {
+         return false; // crosses the eye plane
+      }
+      vec3 ndc = clip.xyz / clip.w;
+      lo = min(lo, ndc.xy);
+      hi = max(hi, ndc.xy);
+      zmin = min(zmin, 0.5*ndc.z + 0.5);
+   }
+
+   lo = clamp(0.5*lo + 0.5, 0.0, 1.0) * viewport;
+   hi = clamp(0.5*hi + 0.5, 0.0, 1.0) * viewport;
+
+   // the level where the rectangle covers at most 2x2 texels
+   vec2 size = hi - lo;
+   int level = int(ceil(log2(max(max(size.x, size.y), 1.0))));
+   level = clamp(level, 0, hizLevels - 1);
+
+   ivec2 levelSize = textureSize(hiz, level);
+   ivec2 a = min(ivec2(lo) >> level, levelSize - 1);
+   ivec2 b = min(ivec2(hi) >> level, levelSize - 1);
+
+   float zmax = 0.0;
+   for (int y = a.y; y <= b.y; y++)
+   for (int x = a.x; x <= b.x; x++)
+   {
+      zmax = max(zmax, texelFetch(hiz, ivec2(x, y), level).r);
+   }
+   return zmin > zmax;
+}
+
+void main()
+{
+   uint n = gl_GlobalInvocationID.x;
+   if (n >= numFaces) { return; }
+
+   uint face = bucketFaces[n];
+   bool vis = visible(face);
+
+   if (phase == 1)
+   {
+      // draw what was visible last frame
+      if (!vis || faceVisible[face] == 0) { return; }
+   }
+   else if (phase == 2)
+   {
+      vis = vis && !occluded(face);
+
+      bool drawn = (faceVisible[face] != 0);
+      faceVisible[face] = vis ? 1 : 0;
+
+      // only faces not drawn in phase 1
+      if (!vis || drawn) { return; }
+   }
+   else if (!vis) { return; }
+
+   int k = 0;
+   while (k+1 < numBuckets && n >= bucketFirst[k+1]) { k++; }
+
+   uint index = atomicAdd(commands[4*k + 1], 1);
+   atomicAdd(commands[4*(MAX_BUCKETS + k) + 1], 1);
+
+   visibleFaces[bucketFirst[k] + index] = face;
+}
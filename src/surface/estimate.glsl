@@ -0,0 +1,74 @@
+#line 2
+
+layout(local_size_x = 64,
+       local_size_y = 1,
+       local_size_z = 1) in;
+
+layout(std430, binding = 0) buffer coefBuffer
+{
+    vec4 coefs[];
+};
+
+// per face: the 4 corners, then (geometry deviation, solution deviation,
+// 0, 0), see SurfaceMesh::FaceInfo
+layout(std430, binding = 1) buffer infoBuffer
+{
+    vec4 info[];
+};
+
+uniform int numFaces;
+
+const int N1 = P+1;
+const int ndof = N1*N1;
+const int infoSize = 5;
+
+
+vec4 evalFace(uint base, float u, float v)
+{
+   float ushape[N1], vshape[N1];
+   lagrangeShape(u, ushape);
+   lagrangeShape(v, vshape);
+
+   vec4 value = vec4(0.0);
+   for (int i = 0; i < N1; i++)
+   for (int j = 0; j < N1; j++)
+   {
+      value += ushape[i]*vshape[j]*coefs[base + N1*i + j];
+   }
+   return value;
+}
+
+
+// Estimate how far each face is from being bilinear: the deviation of the
+// nodal values from the bilinear interpolant of the corners. The error of a
+// level L tesselation is then roughly deviation / L^2.
+void main()
+{
+   uint face = gl_GlobalInvocationID.x;
+   if (face >= numFaces) { return; }
+
+   uint base = face*ndof;
+
+   vec4 c00 = evalFace(base, 0.0, 0.0);
+   vec4 c10 = evalFace(base, 1.0, 0.0);
+   vec4 c11 = evalFace(base, 1.0, 1.0);
+   vec4 c01 = evalFace(base, 0.0, 1.0);
+
+   float geomDev = 0.0, solDev = 0.0;
+   for (int i = 0; i < N1; i++)
+   for (int j = 0; j < N1; j++)
+   {
+      float u = lagrangeNodes[i], v = lagrangeNodes[j];
+      vec4 bilinear = mix(mix(c00, c10, u), mix(c01, c11, u), v);
+      vec4 d = coefs[base + N1*i + j] - bilinear;
+
+      geomDev = max(geomDev, length(d.xyz));
+      solDev = max(solDev, abs(d.w));
+   }
+
+   info[infoSize*face + 0] = c00;
+   info[infoSize*face + 1] = c10;
+   info[infoSize*face + 2] = c11;
+   info[infoSize*face + 3] = c01;
+   info[infoSize*face + 4] = vec4(geomDev, solDev, 0.0, 0.0);
+}
@@ -0,0 +1,189 @@
+#include <iostream>
+#include <algorithm>
+
+#include "hiz.hpp"
+#include "utility.hpp"
+#include "profiler.hpp"
+
+#include "surface/hiz.glsl.hpp"
+
+
+DepthPyramid::~DepthPyramid()
+{
+   discard();
+}
+
+
+void DepthPyramid::initializeGL()
+{
+   Definitions defs, msDefs;
+   defs("MULTISAMPLE", "0");
+   msDefs("MULTISAMPLE", "1");
+
+   progReduce.link(ComputeShader(430, {shaders::surface::hiz}, defs));
+   progReduceMS.link(ComputeShader(430, {shaders::surface::hiz}, msDefs));
+}
+
+
+void DepthPyramid::discard()
+{
+   if (fbo) { glDeleteFramebuffers(1, &fbo); }
+   if (depthTex) { glDeleteTextures(1, &depthTex); }
+   if (pyramidTex) { glDeleteTextures(1, &pyramidTex); }
+   fbo = depthTex = pyramidTex = 0;
+}
+
+
+/// Depth format of the framebuffer 'fb', needed for a depth blit.
+static GLenum depthBufferFormat(GLint fb)
+{
+   GLenum attachment = fb ? GL_DEPTH_ATTACHMENT : GL_DEPTH;
+   GLint depthBits = 0, stencilBits = 0, type = 0;
+
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, fb);
+   glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, attachment,
+      GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+   glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, attachment,
+      GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+   glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, attachment,
+      GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &type);
+
+   if (type == GL_FLOAT) {
+      return stencilBits ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+   }
+   if (depthBits == 16) {
+      return GL_DEPTH_COMPONENT16;
+   }
+   return stencilBits ? GL_DEPTH24_STENCIL8 : GL_DEPTH_COMPONENT24;
+}
+
+
+void DepthPyramid::resize(int w, int h, GLenum format, int samples)
+{
+   discard();
+
+   width = w;
+   height = h;
+   depthFormat = format;
+   depthSamples = samples;
+
+   numLevels = 1;
+   while ((std::max(w, h) >> numLevels) > 0) { numLevels++; }
+
+   // a multisampled copy keeps all samples, level 0 takes the farthest
+   GLenum target = samples ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+
+   glGenTextures(1, &depthTex);
+   glBindTexture(target, depthTex);
+   if (samples)
+   {
+      glTexStorage2DMultisample(target, samples, format, w, h, GL_TRUE);
+   }
+   else
+   {
+      glTexStorage2D(target, 1, format, w, h);
+      glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   }
+
+   glGenTextures(1, &pyramidTex);
+   glBindTexture(GL_TEXTURE_2D, pyramidTex);
+   glTexStorage2D(GL_TEXTURE_2D, numLevels, GL_R32F, w, h);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                   GL_NEAREST_MIPMAP_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+   glGenFramebuffers(1, &fbo);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+   glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER,
+      (format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8)
+         ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+      target, depthTex, 0);
+}
+
+
+bool DepthPyramid::build()
+{
+   GPU_ZONE("depth pyramid");
+
+   GLint viewport[4], drawFb, readFb, samples;
+   glGetIntegerv(GL_VIEWPORT, viewport);
+   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFb);
+   glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFb);
+   glGetIntegerv(GL_SAMPLES, &samples);
+
+   GLenum format = depthBufferFormat(drawFb);
+   bool resized = false;
+   if (viewport[2] != width || viewport[3] != height ||
+       format != depthFormat || samples != depthSamples)
+   {
+      resize(viewport[2], viewport[3], format, samples);
+      resized = true;
+   }
+
+   // copy the depth buffer, a blit can't resolve depth conservatively
+   if (resized) {
+      while (glGetError() != GL_NO_ERROR) {}
+   }
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, drawFb);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+   glBlitFramebuffer(viewport[0], viewport[1],
+                     viewport[0] + width, viewport[1] + height,
+                     0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFb);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, readFb);
+
+   // the format is a guess, a mismatch shows in the first blit after resize
+   if (resized && glGetError() != GL_NO_ERROR)
+   {
+      std::cerr << "Cannot copy the depth buffer (format 0x" << std::hex
+                << format << std::dec << ", " << samples << " samples)."
+                << std::endl;
+      valid = false;
+   }
+   else if (resized)
+   {
+      valid = true;
+   }
+   if (!valid) {
+      return false;
+   }
+
+   Program &prog = samples ? progReduceMS : progReduce;
+   prog.use();
+   glUniform1i(prog.uniform("depth"), 0);
+   if (samples) {
+      glUniform1i(prog.uniform("samples"), samples);
+   }
+
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(samples ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D,
+                 depthTex);
+
+   // level 0 is a copy of the depth, then each level reduces the previous
+   for (int level = 0; level < numLevels; level++)
+   {
+      glUniform1i(prog.uniform("first"), level == 0);
+
+      glBindImageTexture(0, pyramidTex, level, GL_FALSE, 0,
+                         GL_WRITE_ONLY, GL_R32F);
+      glBindImageTexture(1, pyramidTex, std::max(level - 1, 0), GL_FALSE, 0,
+                         GL_READ_ONLY, GL_R32F);
+
+      int w = std::max(1, width >> level), h = std::max(1, height >> level);
+      glDispatchCompute(divRoundUp(w, 8), divRoundUp(h, 8), 1);
+
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                      GL_TEXTURE_FETCH_BARRIER_BIT);
+   }
+   return true;
+}
+
+
+void DepthPyramid::bind(GLuint unit) const
+{
+   glActiveTexture(GL_TEXTURE0 + unit);
+   glBindTexture(GL_TEXTURE_2D, pyramidTex);
+   glActiveTexture(GL_TEXTURE0);
+}
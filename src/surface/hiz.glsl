@@ -0,0 +1,56 @@
+#line 2
+
+// Build one level of the depth pyramid: a copy of the depth texture for
+// level 0 (the farthest sample if it is multisampled), the maximum of the
+// covered texels of the previous level otherwise (including the extra
+// row/column of odd sized levels).
+layout(local_size_x = 8,
+       local_size_y = 8,
+       local_size_z = 1) in;
+
+#if MULTISAMPLE
+uniform sampler2DMS depth;
+uniform int samples;
+#else
+uniform sampler2D depth;
+#endif
+uniform bool first;
+
+layout(r32f, binding = 0) writeonly uniform image2D dst;
+layout(r32f, binding = 1) readonly uniform image2D src;
+
+void main()
+{
+   ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+   ivec2 size = imageSize(dst);
+   if (any(greaterThanEqual(p, size))) { return; }
+
+   float d;
+   if (first)
+   {
+#if MULTISAMPLE
+      d = 0.0;
+      for (int s = 0; s < samples; s++) {
+         d = max(d, texelFetch(depth, p, s).r);
+      }
+#else
+      d = texelFetch(depth, p, 0).r;
+#endif
+   }
+   else
+   {
+      ivec2 srcSize = imageSize(src);
+      ivec2 q = 2*p, last = q + 1;
+      if (p.x == size.x - 1) { last.x = srcSize.x - 1; }
+      if (p.y == size.y - 1) { last.y = srcSize.y - 1; }
+      last = min(last, srcSize - 1);
+
+      d = 0.0;
+      for (int y = q.y; y <= last.y; y++)
+      for (int x = q.x; x <= last.x; x++)
+      {
+         d = max(d, imageLoad(src, ivec2(x, y)).r);
+      }
+   }
+   imageStore(dst, p, vec4(d));
+}
@@ -0,0 +1,53 @@
+#ifndef hogtess_hiz_hpp_included__
+#define hogtess_hiz_hpp_included__
+
+#include "shader.hpp"
+
+
+/** A hierarchical depth buffer: a copy of the depth buffer of the current
+ *  framebuffer, reduced to a mip chain where each texel holds the farthest
+ *  depth of the texels it covers. Used for occlusion culling.
+ */
+class DepthPyramid
+{
+public:
+   DepthPyramid()
+      : width(0), height(0), numLevels(0)
+      , depthFormat(0), depthSamples(0), valid(false)
+      , depthTex(0), pyramidTex(0), fbo(0)
+   {}
+
+   ~DepthPyramid();
+
+   /// Compile shaders.
+   void initializeGL();
+
+   /** Copy the depth of the current viewport and build the mip chain. With
+       a multisampled framebuffer, level 0 holds the farthest sample of each
+       pixel. Returns false if the depth buffer cannot be copied (the
+       pyramid is then not usable). */
+   bool build();
+
+   /// Bind the pyramid (an R32F texture) to a texture unit.
+   void bind(GLuint unit) const;
+
+   int getWidth() const { return width; }
+   int getHeight() const { return height; }
+   int getNumLevels() const { return numLevels; }
+
+protected:
+   int width, height, numLevels;
+
+   GLenum depthFormat;
+   int depthSamples;
+   bool valid;
+   GLuint depthTex, pyramidTex, fbo;
+
+   Program progReduce, progReduceMS;
+
+   void resize(int w, int h, GLenum format, int samples);
+   void discard();
+};
+
+
+#endif // hogtess_hiz_hpp_included__
@@ -0,0 +1,155 @@
+#line 2
+
+// Hardware tesselation path: one patch (with a single dummy vertex) per
+// face, the evaluation shader evaluates the face at the generated points.
+// With LINES defined, the face boundary is drawn as 4 isolines instead.
+
+#if _VERTEX_
+
+void main()
+{
+}
+
+#elif _TESS_CONTROL_
+
+layout(vertices = 1) out;
+
+// levels of the 4 edges of each face (v = 0, u = 1, v = 1, u = 0), 8 bits
+// each, see SurfaceMesh::chooseLevels
+layout(std430, binding = 5) buffer bufFaceEdges
+{
+   uint faceEdges[];
+};
+
+layout(std430, binding = 6) buffer bufFaceLevels
+{
+   uint faceLevels[];
+};
+
+float edgeLevel(uint edges, int e)
+{
+   return float((edges >> (8*e)) & 0xff);
+}
+
+void main()
+{
+   uint face = gl_PrimitiveID;
+   uint edges = faceEdges[face];
+   float level = float(faceLevels[face]);
+
+#if LINES
+   // 4 lines, one for each edge, subdivided at the face level
+   gl_TessLevelOuter[0] = 4.0;
+   gl_TessLevelOuter[1] = level;
+#else
+   // outer levels: u = 0, v = 0, u = 1, v = 1; shared edges get the same
+   // level from both faces, so there are no cracks
+   gl_TessLevelOuter[0] = edgeLevel(edges, 3);
+   gl_TessLevelOuter[1] = edgeLevel(edges, 0);
+   gl_TessLevelOuter[2] = edgeLevel(edges, 1);
+   gl_TessLevelOuter[3] = edgeLevel(edges, 2);
+   gl_TessLevelInner[0] = level;
+   gl_TessLevelInner[1] = level;
+#endif
+}
+
+#elif _TESS_EVAL_
+
+#if LINES
+layout(isolines, equal_spacing) in;
+#else
+layout(quads, equal_spacing, cw) in;
+#endif
+
+out float solution;
+out float gl_ClipDistance[1];
+
+uniform mat4 mvp;
+uniform vec4 clipPlane;
+
+layout(std430, binding = 0) buffer bufCoefs
+{
+   vec4 coefs[];
+};
+
+layout(std430, binding = 2) buffer bufFaceRank
+{
+   int faceRank[];
+};
+
+layout(std430, binding = 3) buffer bufPartMat
+{
+   mat4 matrices[];
+};
+
+layout(std430, binding = 5) buffer bufFaceEdges
+{
+   uint faceEdges[];
+};
+
+layout(std430, binding = 6) buffer bufFaceLevels
+{
+   uint faceLevels[];
+};
+
+const int N1 = P+1;
+const int ndof = N1*N1;
+
+vec4 evalFace(uint face, float u, float v)
+{
+   float ushape[N1], vshape[N1];
+   lagrangeShape(u, ushape);
+   lagrangeShape(v, vshape);
+
+   vec4 value = vec4(0.0);
+   for (int i = 0; i < N1; i++)
+   {
+      vec4 sum = vec4(0.0);
+      for (int j = 0; j < N1; j++) {
+         sum += vshape[j] * coefs[face*ndof + N1*i + j];
+      }
+      value += ushape[i] * sum;
+   }
+   return value;
+}
+
+void main()
+{
+   uint face = gl_PrimitiveID;
+   vec4 vert;
+
+#if LINES
+   // line k of the isolines is edge k (v = 0, u = 1, v = 1, u = 0)
+   int edge = int(round(gl_TessCoord.y * 4.0));
+   uint level = faceLevels[face];
+   uint edgeLevel = (faceEdges[face] >> (8*edge)) & 0xff;
+
+   // snap to the coarser edge level, like the triangles
+   uint along = uint(round(gl_TessCoord.x * float(level)));
+   uint step = level / max(edgeLevel, 1u);
+   uint a = along - along % step;
+   float ta = float(a) / float(level);
+   float tb = float(min(a + step, level)) / float(level);
+   float s = float(along % step) / float(step);
+
+   vec2 uva, uvb;
+   if (edge == 0)      { uva = vec2(ta, 0.0); uvb = vec2(tb, 0.0); }
+   else if (edge == 1) { uva = vec2(1.0, ta); uvb = vec2(1.0, tb); }
+   else if (edge == 2) { uva = vec2(ta, 1.0); uvb = vec2(tb, 1.0); }
+   else                { uva = vec2(0.0, ta); uvb = vec2(0.0, tb); }
+
+   vert = evalFace(face, uva.x, uva.y);
+   if (s > 0.0) {
+      vert = mix(vert, evalFace(face, uvb.x, uvb.y), s);
+   }
+#else
+   vert = evalFace(face, gl_TessCoord.x, gl_TessCoord.y);
+#endif
+
+   vec4 pos = matrices[faceRank[face]] * vec4(vert.xyz, 1);
+   gl_Position = mvp * pos;
+   solution = vert.w;
+   gl_ClipDistance[0] = -dot(pos, clipPlane);
+}
+
+#endif
@@ -2,7 +2,7 @@
 #if _VERTEX_
 
 uniform mat4 mvp;
-uniform int nFaceVert;
+uniform int bucketFirst;
 uniform vec4 clipPlane;
 
 layout(std430, binding = 0) buffer bufVertices
@@ -25,10 +25,22 @@ layout(std430, binding = 3) buffer bufPartMat
    mat4 matrices[];
 };
 
+layout(std430, binding = 4) buffer bufBucketFaces
+{
+   uint bucketFaces[];
+};
+
+layout(std430, binding = 5) buffer bufFaceOffsets
+{
+   uint faceOffsets[];
+};
+
 void main()
 {
-   vec4 vert = vertices[indices[gl_VertexID] + gl_InstanceID*nFaceVert];
-   vec4 pos = matrices[faceRank[gl_InstanceID]] * vec4(vert.xyz, 1);
+   // each instance is one face of the current bucket (tesselation level)
+   uint face = bucketFaces[bucketFirst + gl_InstanceID];
+   vec4 vert = vertices[faceOffsets[face] + indices[gl_VertexID]];
+   vec4 pos = matrices[faceRank[face]] * vec4(vert.xyz, 1);
    gl_Position = mvp * pos;
    gl_ClipDistance[0] = -dot(pos, clipPlane);
 
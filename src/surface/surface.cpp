@@ -1,12 +1,26 @@
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+#include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "surface.hpp"
 #include "utility.hpp"
+#include "profiler.hpp"
 #include "shape/shape.hpp"
 #include "palette.hpp"
+#include "cpu/tesselate.hpp"
+#include "cpu/simd.hpp"
 
 #include "shape/shape.glsl.hpp"
 #include "surface/tesselate.glsl.hpp"
+#include "surface/estimate.glsl.hpp"
+#include "surface/copy.glsl.hpp"
+#include "surface/hwtess.glsl.hpp"
+#include "surface/bounds.glsl.hpp"
+#include "surface/cull.glsl.hpp"
 #include "surface/draw.glsl.hpp"
 #include "surface/lines.glsl.hpp"
 
@@ -17,15 +31,43 @@ void SurfaceMesh::initializeGL(int order)
 
    Definitions defs;
    defs("P", std::to_string(order))
+       ("MAX_LEVEL", std::to_string(MaxTessLevel))
        ("PALETTE_SIZE", std::to_string(RGB_Palette_3_Size));
 
-   ShaderSource::list computeSurface{
-      shaders::shape,
-      shaders::surface::tesselate
-   };
+   // work group size: as large as the limits allow, up to 256 invocations
+   GLint maxSize, maxInvocations, maxShared;
+   glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSize);
+   glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+   glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &maxShared);
+
+   localSize = std::min(256, std::min(maxSize, maxInvocations));
+
+   // faces per work group: up to 4, using at most half of the shared memory
+   int faceBytes = 4*sizeof(float)*(order+1)*(order+1 + MaxTessLevel+1);
+   facesPerGroup = std::max(1, std::min(4, maxShared / 2 / faceBytes));
+
+   Definitions computeDefs(defs);
+   computeDefs("LOCAL_SIZE", std::to_string(localSize))
+              ("FACES", std::to_string(facesPerGroup));
 
    progCompute.link(
-      ComputeShader(version, computeSurface, defs));
+      ComputeShader(version, {shaders::surface::tesselate}, computeDefs));
+
+   progEstimate.link(
+      ComputeShader(version, {shaders::shape, shaders::surface::estimate},
+                    defs));
+
+   progCopy.link(
+      ComputeShader(version, {shaders::surface::copy}, defs));
+
+   progBounds.link(
+      ComputeShader(version, {shaders::surface::bounds}, defs));
+
+   Definitions cullDefs(defs);
+   cullDefs("MAX_BUCKETS", std::to_string(int(MaxLevels)));
+
+   progCull.link(
+      ComputeShader(version, {shaders::surface::cull}, cullDefs));
 
    progDraw.link(
       VertexShader(version, {shaders::surface::draw}, defs),
@@ -35,42 +77,501 @@ void SurfaceMesh::initializeGL(int order)
       VertexShader(version, {shaders::surface::lines}, defs),
       FragmentShader(version, {shaders::surface::lines}, defs));
 
+   // hardware tesselation, evaluating the faces in the TES
+   for (int lines = 0; lines < 2; lines++)
+   {
+      Definitions hwDefs(defs);
+      hwDefs("LINES", std::to_string(lines));
+
+      (lines ? progPatchLines : progPatches).link(
+         VertexShader(version, {shaders::surface::hwtess}, hwDefs),
+         TessControlShader(version, {shaders::surface::hwtess}, hwDefs),
+         TessEvalShader(version, {shaders::shape, shaders::surface::hwtess},
+                        hwDefs),
+         FragmentShader(version,
+                        {lines ? ShaderSource(shaders::surface::lines)
+                               : ShaderSource(shaders::surface::draw)},
+                        defs));
+   }
+
+   hiz.initializeGL();
+
    // create an empty VAO
    glGenVertexArrays(1, &vao);
 }
 
 
+void SurfaceMesh::estimate()
+{
+   static_assert(sizeof(FaceInfo) == 5*4*sizeof(float),
+                 "FaceInfo must match the layout in estimate.glsl");
+
+   bufFaceInfo.resize(long(numFaces)*sizeof(FaceInfo));
+
+   progEstimate.use();
+   lagrangeUniforms(progEstimate, solution.order(), solution.nodes1d());
+   glUniform1i(progEstimate.uniform("numFaces"), numFaces);
+
+   coefs.buffer().bind(0);
+   bufFaceInfo.bind(1);
+
+   GPU_ZONE("estimate");
+   glDispatchCompute(divRoundUp(numFaces, 64), 1, 1);
+   glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+   // the estimates only depend on the coefficients, keep a host copy
+   faceInfo.resize(numFaces);
+   bufFaceInfo.download(faceInfo.data(), faceInfo.size()*sizeof(FaceInfo));
+
+   faceRanks.resize(numFaces);
+   coefs.faceRanks().download(faceRanks.data(), numFaces*sizeof(int));
+
+   findEdges();
+}
+
+
+void SurfaceMesh::findEdges()
+{
+   // faces share an edge if the (quantized) end points of the edge match
+   const float quantum = 1e-5f;
+
+   struct EdgeKey
+   {
+      long q[6];
+      int index; // 4*face + edge
+
+      bool operator<(const EdgeKey &other) const
+      {
+         return std::lexicographical_compare(q, q + 6,
+                                             other.q, other.q + 6);
+      }
+   };
+
+   std::vector<EdgeKey> keys(4*numFaces);
+   for (int i = 0; i < numFaces; i++)
+   {
+      for (int e = 0; e < 4; e++)
+      {
+         const float *a = faceInfo[i].corners[e];
+         const float *b = faceInfo[i].corners[(e + 1) % 4];
+
+         EdgeKey &key = keys[4*i + e];
+         for (int j = 0; j < 3; j++)
+         {
+            key.q[j] = std::lround(a[j] / quantum);
+            key.q[3 + j] = std::lround(b[j] / quantum);
+         }
+         // the neighbor may traverse the edge in the opposite direction
+         if (std::lexicographical_compare(key.q + 3, key.q + 6,
+                                          key.q, key.q + 3))
+         {
+            std::swap_ranges(key.q, key.q + 3, key.q + 3);
+         }
+         key.index = 4*i + e;
+      }
+   }
+   std::sort(keys.begin(), keys.end());
+
+   faceEdgeIds.resize(4*numFaces);
+   numEdges = 0;
+   for (unsigned i = 0; i < keys.size(); i++)
+   {
+      if (i && keys[i-1] < keys[i]) { numEdges++; }
+      faceEdgeIds[keys[i].index] = numEdges;
+   }
+   if (numFaces) { numEdges++; }
+}
+
+
+int SurfaceMesh::faceLevel(const FaceInfo &info) const
+{
+   // the interpolation error of a level L mesh is about dev/L^2,
+   // take the coarsest level that meets the tolerance
+   for (int k = numLevels-1; k > 0; k--)
+   {
+      float l2 = sqr(float(levels[k]));
+      if (info.geomDev <= tolerance*l2 && info.solDev <= tolerance*l2) {
+         return k;
+      }
+   }
+   return 0;
+}
+
+
+int SurfaceMesh::viewLevel(const FaceInfo &info, const glm::mat4 &mvp,
+                           const Buffer &bufPartMat, int rank,
+                           const int viewport[4]) const
+{
+   // bounding sphere of the face
+   glm::vec3 corners[4], center(0.0f);
+   for (int i = 0; i < 4; i++)
+   {
+      const float *c = info.corners[i];
+      corners[i] = glm::vec3(c[0], c[1], c[2]);
+      center += 0.25f*corners[i];
+   }
+   float radius = 0;
+   for (int i = 0; i < 4; i++) {
+      radius = std::max(radius, glm::length(corners[i] - center));
+   }
+   radius += info.geomDev;
+
+   glm::mat4 m = mvp;
+   if (bufPartMat.data()) {
+      m = mvp * bufPartMat.data<glm::mat4>(rank);
+   }
+
+   glm::vec4 clip = m * glm::vec4(center, 1.0f);
+   if (clip.w <= radius) {
+      return 0; // close to or behind the eye
+   }
+
+   // projected size in pixels
+   float sx = glm::length(glm::vec3(m[0][0], m[1][0], m[2][0])) * viewport[2];
+   float sy = glm::length(glm::vec3(m[0][1], m[1][1], m[2][1])) * viewport[3];
+   float pixels = radius * std::max(sx, sy) / clip.w;
+
+   // coarsest level with segments of at most 'lodPixels'
+   for (int k = numLevels-1; k > 0; k--)
+   {
+      if (levels[k]*lodPixels >= pixels) { return k; }
+   }
+   return 0;
+}
+
+
+void SurfaceMesh::chooseLevels(const glm::mat4 *mvp, const Buffer *bufPartMat)
+{
+   int viewport[4];
+   glGetIntegerv(GL_VIEWPORT, viewport);
+
+   faceLevels.resize(numFaces);
+   OMP(parallel for)
+   for (int i = 0; i < numFaces; i++)
+   {
+      int k = numLevels-1;
+      if (adaptive) {
+         k = std::min(k, faceLevel(faceInfo[i]));
+      }
+      if (mvp) {
+         k = std::min(k, viewLevel(faceInfo[i], *mvp, *bufPartMat,
+                                   faceRanks[i], viewport));
+      }
+      faceLevels[i] = k;
+   }
+
+   // shared edges are tesselated at the coarser of the two levels
+   std::vector<unsigned char> edgeLevels(numEdges, 0);
+   if (numLevels > 1)
+   {
+      for (int i = 0; i < numFaces; i++)
+      {
+         for (int e = 0; e < 4; e++)
+         {
+            unsigned char &el = edgeLevels[faceEdgeIds[4*i + e]];
+            el = std::max(el, faceLevels[i]);
+         }
+      }
+   }
+
+   faceEdges.resize(numFaces);
+   for (int i = 0; i < numFaces; i++)
+   {
+      unsigned packed = 0;
+      for (int e = 0; e < 4; e++)
+      {
+         int k = (numLevels > 1) ? edgeLevels[faceEdgeIds[4*i + e]]
+                                 : faceLevels[i];
+         packed |= unsigned(levels[k]) << (8*e);
+      }
+      faceEdges[i] = packed;
+   }
+}
+
+
+void SurfaceMesh::update()
+{
+   PROFILE_ZONE("update surface");
+
+   std::vector<unsigned> tessLevels(numFaces);
+   for (int i = 0; i < numFaces; i++) {
+      tessLevels[i] = levels[faceLevels[i]];
+   }
+   bufFaceTessLevels.upload(tessLevels);
+
+   if (hardware)
+   {
+      // no vertices, the tesselator only needs the levels
+      bufFaceEdges.upload(faceEdges);
+
+      bufVertices[0].discard();
+      bufVertices[1].discard();
+      prevFaceLevels.clear();
+      return;
+   }
+
+   bool all = (int(prevFaceLevels.size()) != numFaces);
+
+   std::fill(bucketCount, bucketCount + MaxLevels, 0);
+   int tessCount[MaxLevels] = {0};
+
+   std::vector<bool> changed(numFaces, true);
+   for (int i = 0; i < numFaces; i++)
+   {
+      int k = faceLevels[i];
+      bucketCount[k]++;
+
+      if (!all && faceLevels[i] == prevFaceLevels[i] &&
+          faceEdges[i] == prevFaceEdges[i])
+      {
+         changed[i] = false;
+      }
+      else {
+         tessCount[k]++;
+      }
+   }
+
+   int tessFirst[MaxLevels];
+   for (int k = 0, total = 0, tessTotal = 0; k < numLevels; k++)
+   {
+      bucketFirst[k] = total;
+      tessFirst[k] = tessTotal;
+      total += bucketCount[k];
+      tessTotal += tessCount[k];
+   }
+
+   // pack the faces in vertex buffer order, list the faces to tesselate
+   std::vector<unsigned> bucketFaces(numFaces), tessFaces;
+   std::vector<int> next(bucketFirst, bucketFirst + numLevels);
+   std::vector<int> tessNext(tessFirst, tessFirst + numLevels);
+   tessFaces.resize(tessFirst[numLevels-1] + tessCount[numLevels-1]);
+
+   faceOffsets.resize(numFaces);
+   long numVerts = 0;
+   for (int i = 0; i < numFaces; i++)
+   {
+      int k = faceLevels[i];
+      bucketFaces[next[k]++] = i;
+      if (changed[i]) { tessFaces[tessNext[k]++] = i; }
+      faceOffsets[i] = numVerts;
+      numVerts += sqr(levels[k] + 1);
+   }
+
+   // the unchanged faces are copied from the previous buffer, in runs
+   std::vector<unsigned> copies; // (from, to, count, 0)
+   for (int i = 0; i < numFaces; i++)
+   {
+      if (changed[i]) { continue; }
+
+      unsigned from = prevFaceOffsets[i], to = faceOffsets[i];
+      unsigned count = sqr(levels[faceLevels[i]] + 1);
+
+      int n = copies.size();
+      if (n && copies[n-4] + copies[n-2] == from &&
+               copies[n-3] + copies[n-2] == to)
+      {
+         copies[n-2] += count;
+      }
+      else
+      {
+         unsigned copy[4] = { from, to, count, 0 };
+         copies.insert(copies.end(), copy, copy + 4);
+      }
+   }
+
+   if (all)
+   {
+      // occlusion culling starts with all faces visible
+      bufFaceVisible.upload(std::vector<unsigned>(numFaces, 1));
+   }
+
+   Buffer &src = bufVertices[curVertices];
+   curVertices ^= 1;
+   Buffer &dst = bufVertices[curVertices];
+
+   dst.resize(4*sizeof(float)*numVerts);
+   bufBucketFaces.upload(bucketFaces);
+   bufFaceOffsets.upload(faceOffsets);
+   bufFaceEdges.upload(faceEdges);
+
+   if (copies.size())
+   {
+      int numCopies = copies.size() / 4;
+      bufCopies.upload(copies);
+
+      progCopy.use();
+      glUniform1i(progCopy.uniform("numCopies"), numCopies);
+
+      src.bind(0);
+      dst.bind(1);
+      bufCopies.bind(2);
+
+      GPU_ZONE("copy faces");
+      glDispatchCompute(std::min(numCopies, 65535), 1, 1);
+   }
+
+   if (tessFaces.size())
+   {
+      bufTessFaces.upload(tessFaces);
+
+      progCompute.use();
+
+      coefs.buffer().bind(0);
+      dst.bind(1);
+      bufBasis.bind(2);
+      bufTessFaces.bind(3);
+      bufFaceOffsets.bind(4);
+      bufFaceEdges.bind(5);
+
+      // launch the compute shader for each bucket,
+      // 'facesPerGroup' faces per work group
+      for (int k = 0; k < numLevels; k++)
+      {
+         if (!tessCount[k]) { continue; }
+
+         glUniform1i(progCompute.uniform("level"), levels[k]);
+         glUniform1i(progCompute.uniform("numFaces"), tessCount[k]);
+         glUniform1i(progCompute.uniform("firstFace"), tessFirst[k]);
+         glUniform1i(progCompute.uniform("basisOffset"), basisOffset[k]);
+
+         GPU_ZONE("tesselate");
+         glDispatchCompute(divRoundUp(tessCount[k], facesPerGroup), 1, 1);
+      }
+
+      // update the culling bounds of the new faces
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+      int numTess = tessFaces.size();
+      bufFaceBounds.resize(3*4*sizeof(float)*numFaces);
+
+      progBounds.use();
+      glUniform1i(progBounds.uniform("numFaces"), numTess);
+
+      dst.bind(0);
+      bufTessFaces.bind(1);
+      bufFaceOffsets.bind(2);
+      bufFaceTessLevels.bind(3);
+      bufFaceBounds.bind(4);
+
+      GPU_ZONE("face bounds");
+      glDispatchCompute(std::min(numTess, 65535), 1, 1);
+   }
+
+   // wait until we can use the computed vertices (also for the next copy)
+   glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                   GL_SHADER_STORAGE_BARRIER_BIT);
+
+   prevFaceLevels = faceLevels;
+   prevFaceEdges = faceEdges;
+   prevFaceOffsets.swap(faceOffsets);
+
+   if (all && numLevels > 1)
+   {
+      std::cout << "Levels:";
+      for (int k = 0; k < numLevels; k++)
+      {
+         std::cout << " " << levels[k] << " (" << bucketCount[k] << ")";
+      }
+      std::cout << ", " << numVerts << " vertices." << std::endl;
+   }
+}
+
+
 void SurfaceMesh::tesselate(int level)
 {
+   PROFILE_ZONE("tesselate surface");
+
    numFaces = coefs.numFaces();
    tessLevel = level;
 
-   int faceVerts = sqr(level + 1);
-   long vbSize = 4*sizeof(float)*faceVerts*numFaces;
+   // available levels: 'level' and its halvings, as long as they are whole
+   numLevels = 0;
+   for (int l = level; ; l /= 2)
+   {
+      levels[numLevels++] = l;
+      if (!(adaptive || viewLod) || l % 2 || numLevels == MaxLevels) { break; }
+   }
+
+   if ((adaptive || viewLod) && int(faceInfo.size()) != numFaces) {
+      estimate();
+   }
+
+   // basis tables of all levels, one after another
+   std::vector<float> basis;
+   for (int k = 0; k < numLevels; k++)
+   {
+      basisOffset[k] = basis.size();
+      std::vector<float> table =
+         lagrangeTable(solution.order(), solution.nodes1d(), levels[k]);
+      basis.insert(basis.end(), table.begin(), table.end());
+   }
+   bufBasis.upload(basis);
 
-   bufVertices.resize(vbSize);
+   for (int k = 0; k < numLevels; k++)
+   {
+      makeQuadFaceIndexBuffers(levels[k], bufIndices[k], bufLineIndices[k]);
+   }
 
-   progCompute.use();
-   glUniform1i(progCompute.uniform("level"), level);
-   glUniform1f(progCompute.uniform("invLevel"), 1.0 / level);
+   progPatches.use();
+   lagrangeUniforms(progPatches, solution.order(), solution.nodes1d());
+   progPatchLines.use();
+   lagrangeUniforms(progPatchLines, solution.order(), solution.nodes1d());
 
-   lagrangeUniforms(progCompute, solution.order(), solution.nodes1d());
+   // everything needs to be tesselated again
+   prevFaceLevels.clear();
+   lodValid = false;
 
-   coefs.buffer().bind(0);
-   bufVertices.bind(1);
+   if (!viewLod)
+   {
+      chooseLevels(nullptr, nullptr);
+      update();
+   }
+   // otherwise the levels are chosen in draw(), for the current view
+}
 
-   // launch the compute shader
-   // TODO: group size 32 in Z
-   glDispatchCompute(level+1, level+1, numFaces);
 
-   // wait until we can use the computed vertices
-   glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+double SurfaceMesh::verify()
+{
+   if (hardware || int(prevFaceLevels.size()) != numFaces) {
+      std::cout << "No vertex buffer to verify." << std::endl;
+      return -1;
+   }
 
-   makeQuadFaceIndexBuffers(level);
+   // the previous arrays describe the current buffer after update()
+   std::vector<int> faceTessLevels(numFaces);
+   long numVerts = 0;
+   for (int i = 0; i < numFaces; i++)
+   {
+      faceTessLevels[i] = levels[prevFaceLevels[i]];
+      numVerts += sqr(faceTessLevels[i] + 1);
+   }
+
+   std::vector<float> faceCoefs(4L*numFaces*coefs.numDofs());
+   coefs.buffer().download(faceCoefs.data(), faceCoefs.size()*sizeof(float));
+
+   std::vector<float> gpu(4*numVerts), cpu(4*numVerts);
+   bufVertices[curVertices].download(gpu.data(), gpu.size()*sizeof(float));
+
+   ProfileZone zone("tesselate (CPU)");
+   CpuTesselator tess(solution.order(), solution.nodes1d());
+   tess.tesselateFaces(faceCoefs.data(), numFaces, faceTessLevels.data(),
+                       prevFaceEdges.data(), prevFaceOffsets.data(),
+                       cpu.data());
+   double time = zone.elapsed();
+
+   double maxDiff = 0;
+   for (long i = 0; i < 4*numVerts; i++) {
+      maxDiff = std::max(maxDiff, double(std::abs(gpu[i] - cpu[i])));
+   }
+
+   std::cout << "CPU tesselation (" << simdName() << "): " << numVerts
+             << " vertices in " << time << " s, max. difference "
+             << maxDiff << "." << std::endl;
+   return maxDiff;
 }
 
 
-void SurfaceMesh::makeQuadFaceIndexBuffers(int level)
+void makeQuadFaceIndexBuffers(int level, Buffer &triangles, Buffer &lines)
 {
    int nTri = 2*sqr(level);
    int nLines = 4*level;
@@ -106,7 +607,7 @@ void SurfaceMesh::makeQuadFaceIndexBuffers(int level)
       }
    }
 
-   bufIndices.upload(indices, 3*nTri*sizeof(int));
+   triangles.upload(indices, 3*nTri*sizeof(int));
 
    n = 0;
    for (int i = 0; i < level; i++)
@@ -124,7 +625,7 @@ void SurfaceMesh::makeQuadFaceIndexBuffers(int level)
       indices[n++] = (level+1)*(i+1) + level;
    }
 
-   bufLineIndices.upload(indices, 2*nLines*sizeof(int));
+   lines.upload(indices, 2*nLines*sizeof(int));
 
    delete [] indices;
 }
@@ -133,27 +634,94 @@ void SurfaceMesh::makeQuadFaceIndexBuffers(int level)
 void SurfaceMesh::draw(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
                        const Buffer &bufPartMat, bool lines)
 {
-   int nFaceVert = sqr(tessLevel + 1);
-   int nFaceTri = 2*sqr(tessLevel);
-   int nFaceLines = 4*tessLevel;
+   PROFILE_ZONE("draw surface");
+
+   if (viewLod &&
+       (!lodValid ||
+        std::memcmp(lodMvp, glm::value_ptr(mvp), sizeof(lodMvp))))
+   {
+      std::memcpy(lodMvp, glm::value_ptr(mvp), sizeof(lodMvp));
+      lodValid = true;
+
+      chooseLevels(&mvp, &bufPartMat);
+      update();
+   }
+
+   if (hardware)
+   {
+      drawPatches(mvp, clipPlane, bufPartMat, lines);
+      return;
+   }
+
+   if (culling && occlusion)
+   {
+      // draw the faces visible last frame, then the ones they don't hide
+      cull(mvp, clipPlane, bufPartMat, 1);
+      drawFaces(mvp, clipPlane, bufPartMat, lines);
+
+      if (hiz.build())
+      {
+         cull(mvp, clipPlane, bufPartMat, 2);
+      }
+      else
+      {
+         // no usable depth copy, fall back to frustum culling only
+         occlusion = false;
+         cull(mvp, clipPlane, bufPartMat, 0);
+      }
+      drawFaces(mvp, clipPlane, bufPartMat, lines);
+   }
+   else
+   {
+      if (culling) {
+         cull(mvp, clipPlane, bufPartMat, 0);
+      }
+      drawFaces(mvp, clipPlane, bufPartMat, lines);
+   }
+}
+
+
+void SurfaceMesh::drawFaces(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+                            const Buffer &bufPartMat, bool lines)
+{
+   // list of faces to draw, all of them unless culled
+   const Buffer &faces = culling ? bufVisibleFaces : bufBucketFaces;
 
    progDraw.use();
    glUniformMatrix4fv(progDraw.uniform("mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
-   glUniform1i(progDraw.uniform("nFaceVert"), nFaceVert);
    glUniform4fv(progDraw.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
    glUniform3fv(progDraw.uniform("palette"), RGB_Palette_3_Size,
                 (const float*) RGB_Palette_3);
 
-   bufVertices.bind(0);
-   bufIndices.bind(1);
+   bufVertices[curVertices].bind(0);
    coefs.faceRanks().bind(2);
    bufPartMat.bind(3);
+   faces.bind(4);
+   bufFaceOffsets.bind(5);
 
    glEnable(GL_POLYGON_OFFSET_FILL);
    glPolygonOffset(1, 1); // push triangles behind lines
 
    glBindVertexArray(vao);
-   glDrawArraysInstanced(GL_TRIANGLES, 0, 3*nFaceTri, numFaces);
+
+   // one instanced draw per bucket
+   for (int k = 0; k < numLevels; k++)
+   {
+      if (!bucketCount[k]) { continue; }
+
+      int nFaceTri = 2*sqr(levels[k]);
+
+      bufIndices[k].bind(1);
+      glUniform1i(progDraw.uniform("bucketFirst"), bucketFirst[k]);
+
+      GPU_ZONE("draw faces");
+      if (culling) {
+         glDrawArraysIndirect(GL_TRIANGLES, (void*) (4*sizeof(GLuint)*k));
+      }
+      else {
+         glDrawArraysInstanced(GL_TRIANGLES, 0, 3*nFaceTri, bucketCount[k]);
+      }
+   }
 
    glDisable(GL_POLYGON_OFFSET_FILL);
    glPolygonOffset(0, 0);
@@ -161,17 +729,133 @@ void SurfaceMesh::draw(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
    if (lines)
    {
       progLines.use();
-      glUniformMatrix4fv(progDraw.uniform("mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
-      glUniform1i(progLines.uniform("nFaceVert"), nFaceVert);
-      glUniform4fv(progDraw.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+      glUniformMatrix4fv(progLines.uniform("mvp"), 1, GL_FALSE,
+                         glm::value_ptr(mvp));
+      glUniform4fv(progLines.uniform("clipPlane"), 1,
+                   glm::value_ptr(clipPlane));
 
-      bufVertices.bind(0);
-      bufLineIndices.bind(1);
+      bufVertices[curVertices].bind(0);
       coefs.faceRanks().bind(2);
       bufPartMat.bind(3);
+      faces.bind(4);
+      bufFaceOffsets.bind(5);
 
       glBindVertexArray(vao);
-      glDrawArraysInstanced(GL_LINES, 0, 2*nFaceLines, numFaces);
+
+      for (int k = 0; k < numLevels; k++)
+      {
+         if (!bucketCount[k]) { continue; }
+
+         int nFaceLines = 4*levels[k];
+
+         bufLineIndices[k].bind(1);
+         glUniform1i(progLines.uniform("bucketFirst"), bucketFirst[k]);
+
+         GPU_ZONE("draw face lines");
+         if (culling)
+         {
+            glDrawArraysIndirect(GL_LINES,
+                                 (void*) (4*sizeof(GLuint)*(MaxLevels + k)));
+         }
+         else {
+            glDrawArraysInstanced(GL_LINES, 0, 2*nFaceLines, bucketCount[k]);
+         }
+      }
    }
 }
 
+
+void SurfaceMesh::cull(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+                       const Buffer &bufPartMat, int phase)
+{
+   // draw commands with no instances yet, the cull shader counts them
+   std::vector<GLuint> commands(2*4*MaxLevels, 0);
+   for (int k = 0; k < numLevels; k++)
+   {
+      commands[4*k] = 3*2*sqr(levels[k]);
+      commands[4*(MaxLevels + k)] = 2*4*levels[k];
+   }
+   bufCullCommands.upload(commands);
+   bufVisibleFaces.resize(sizeof(GLuint)*numFaces);
+
+   // eye position: the world point that projects to (0, 0, z, 0)
+   glm::vec4 eye = glm::inverse(mvp) * glm::vec4(0, 0, 1, 0);
+
+   progCull.use();
+   glUniformMatrix4fv(progCull.uniform("mvp"), 1, GL_FALSE,
+                      glm::value_ptr(mvp));
+   glUniform4fv(progCull.uniform("clipPlane"), 1, glm::value_ptr(clipPlane));
+   glUniform1i(progCull.uniform("useClipPlane"),
+               glIsEnabled(GL_CLIP_DISTANCE0));
+   glUniform3f(progCull.uniform("eye"),
+               eye.x / eye.w, eye.y / eye.w, eye.z / eye.w);
+   glUniform1i(progCull.uniform("numFaces"), numFaces);
+   glUniform1i(progCull.uniform("numBuckets"), numLevels);
+   glUniform1iv(progCull.uniform("bucketFirst"), numLevels, bucketFirst);
+   glUniform1i(progCull.uniform("phase"), phase);
+
+   if (phase == 2)
+   {
+      hiz.bind(1);
+      glUniform1i(progCull.uniform("hiz"), 1);
+      glUniform1i(progCull.uniform("hizLevels"), hiz.getNumLevels());
+      glUniform2f(progCull.uniform("viewport"),
+                  hiz.getWidth(), hiz.getHeight());
+   }
+
+   bufBucketFaces.bind(0);
+   bufFaceBounds.bind(1);
+   coefs.faceRanks().bind(2);
+   bufPartMat.bind(3);
+   bufVisibleFaces.bind(4);
+   bufCullCommands.bind(5);
+   bufFaceVisible.bind(6);
+
+   GPU_ZONE("cull faces");
+   glDispatchCompute(divRoundUp(numFaces, 64), 1, 1);
+
+   glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+   bufCullCommands.bindTo(GL_DRAW_INDIRECT_BUFFER);
+}
+
+
+void SurfaceMesh::drawPatches(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+                              const Buffer &bufPartMat, bool lines)
+{
+   progPatches.use();
+   glUniformMatrix4fv(progPatches.uniform("mvp"), 1, GL_FALSE,
+                      glm::value_ptr(mvp));
+   glUniform4fv(progPatches.uniform("clipPlane"), 1,
+                glm::value_ptr(clipPlane));
+   glUniform3fv(progPatches.uniform("palette"), RGB_Palette_3_Size,
+                (const float*) RGB_Palette_3);
+
+   coefs.buffer().bind(0);
+   coefs.faceRanks().bind(2);
+   bufPartMat.bind(3);
+   bufFaceEdges.bind(5);
+   bufFaceTessLevels.bind(6);
+
+   glEnable(GL_POLYGON_OFFSET_FILL);
+   glPolygonOffset(1, 1); // push triangles behind lines
+
+   // one patch per face, gl_PrimitiveID is the face index
+   GPU_ZONE("draw patches");
+   glBindVertexArray(vao);
+   glPatchParameteri(GL_PATCH_VERTICES, 1);
+   glDrawArrays(GL_PATCHES, 0, numFaces);
+
+   glDisable(GL_POLYGON_OFFSET_FILL);
+   glPolygonOffset(0, 0);
+
+   if (lines)
+   {
+      progPatchLines.use();
+      glUniformMatrix4fv(progPatchLines.uniform("mvp"), 1, GL_FALSE,
+                         glm::value_ptr(mvp));
+      glUniform4fv(progPatchLines.uniform("clipPlane"), 1,
+                   glm::value_ptr(clipPlane));
+
+      glDrawArrays(GL_PATCHES, 0, numFaces);
+   }
+}
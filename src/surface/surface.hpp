@@ -1,17 +1,42 @@
 #ifndef hogtess_surface_hpp_included__
 #define hogtess_surface_hpp_included__
 
+#include <vector>
+
 #include <glm/fwd.hpp>
 
 #include "input/input.hpp"
 #include "shader.hpp"
+#include "hiz.hpp"
 
 
 /** Encapsulates the ability to tesselate faces using a compute shader and
  *  subsequently to draw their meshes with an instanced draw command.
  *
- *  The vertex buffer holds sqr(tessLevel+1) vertices for each face.
- *  The index buffer exists for one face instance only and is used repeatedly.
+ *  In adaptive mode each face gets its own level, chosen from tessLevel,
+ *  tessLevel/2, ... by how far the face is from being bilinear. In the view
+ *  dependent mode the level also follows the projected size of the face.
+ *  Faces with the same level form a bucket, which is tesselated by one
+ *  dispatch and drawn by one instanced draw. The vertex buffer holds
+ *  sqr(level+1) vertices for each face, packed at 'faceOffsets'. There is an
+ *  index buffer for one face instance of each level, used repeatedly.
+ *
+ *  An edge shared by faces of different levels is tesselated at the coarser
+ *  level by both faces (the finer face snaps its extra edge vertices to the
+ *  coarse segments), so there are no cracks. When the view changes, only
+ *  the faces whose level or edge levels changed are tesselated again, the
+ *  others are copied from the previous vertex buffer.
+ *
+ *  With culling on, a compute pass tests the bounding box and normal cone of
+ *  each face (computed after tesselation) against the view frustum, the
+ *  clip plane and the eye every frame, and compacts the visible faces of
+ *  each bucket for indirect draws. Occlusion culling adds a second phase:
+ *  the faces visible in the last frame are drawn first, the remaining ones
+ *  are then tested against a depth pyramid built from that frame.
+ *
+ *  In the hardware mode there is no vertex buffer: each face is drawn as a
+ *  patch, tesselated by the fixed function tesselator at the same face and
+ *  edge levels and evaluated in the tesselation evaluation shader.
  */
 class SurfaceMesh
 {
@@ -19,9 +44,15 @@ public:
    SurfaceMesh(const Solution &solution,
                const SurfaceCoefs &coefs)
       : solution(solution), coefs(coefs)
-      , numFaces(0), tessLevel(0), vao(0)
+      , numFaces(0), tessLevel(0), localSize(0), facesPerGroup(1)
+      , adaptive(false), tolerance(1e-3f)
+      , viewLod(false), lodPixels(8.0f), lodValid(false), hardware(false)
+      , culling(true), occlusion(false)
+      , numLevels(0), numEdges(0), curVertices(0), vao(0)
    {}
 
+   enum { MaxLevels = 6 }; // MaxTessLevel, MaxTessLevel/2, ..., 1
+
    /// Compile shaders.
    void initializeGL(int order);
 
@@ -29,6 +60,34 @@ public:
        multiple of 2. This function may only be called when 'level' changes. */
    void tesselate(int level);
 
+   /** Enable per-face levels. The tesselation level passed to tesselate()
+       becomes the maximum level. Call tesselate() again to apply. */
+   void setAdaptive(bool a) { adaptive = a; }
+   bool getAdaptive() const { return adaptive; }
+
+   /** Enable view dependent levels, updated in draw() when the view changes.
+       Call tesselate() again to apply. */
+   void setViewLod(bool lod) { viewLod = lod; }
+   bool getViewLod() const { return viewLod; }
+
+   /** Use hardware tesselation shaders instead of the compute shader and
+       the vertex buffer. Call tesselate() again to apply. */
+   void setHardware(bool hw) { hardware = hw; }
+   bool getHardware() const { return hardware; }
+
+   /// Enable frustum, clip plane and back-face culling of whole faces.
+   void setCulling(bool c) { culling = c; }
+   bool getCulling() const { return culling; }
+
+   /// Enable two-phase occlusion culling (needs culling on).
+   void setOcclusion(bool o) { occlusion = o; }
+   bool getOcclusion() const { return occlusion; }
+
+   /** Compare the current vertex buffer with a CPU tesselation of the same
+       faces and levels (see CpuTesselator) and print the difference.
+       Returns the maximum difference, or -1 if there are no vertices. */
+   double verify();
+
    /// Draw the tesselated faces. Can be called many times.
    void draw(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
              const Buffer &bufPartMat, bool lines);
@@ -38,16 +97,80 @@ protected:
    const SurfaceCoefs &coefs;
 
    int numFaces, tessLevel;
+   int localSize, facesPerGroup; // tesselation work group layout
 
-   Program progCompute, progDraw, progLines;
+   bool adaptive;
+   float tolerance; // max. deviation from the exact surface (normalized)
 
-   Buffer bufVertices;
-   Buffer bufIndices, bufLineIndices;
+   /// Result of the estimate pass, read back to the host.
+   struct FaceInfo
+   {
+      float corners[4][4]; // xyzw at (0,0), (1,0), (1,1), (0,1)
+      float geomDev, solDev, pad[2];
+   };
+   std::vector<FaceInfo> faceInfo;
+   std::vector<int> faceRanks;
+
+   bool viewLod;
+   float lodPixels;  // desired size of a tesselation segment on screen
+   bool lodValid;
+   float lodMvp[16]; // view the current levels were chosen for
+
+   bool hardware;
+   bool culling, occlusion;
+   DepthPyramid hiz;
+
+   // buckets of faces with the same level, finest first
+   int numLevels;
+   int levels[MaxLevels];
+   int bucketFirst[MaxLevels], bucketCount[MaxLevels];
+   int basisOffset[MaxLevels]; // of each level's table in bufBasis
+
+   // unique geometric edges, 4 per face: v = 0, u = 1, v = 1, u = 0
+   int numEdges;
+   std::vector<int> faceEdgeIds;
+
+   // per face level (index to 'levels') and packed edge levels, the 'prev'
+   // versions describe the contents of the previous vertex buffer
+   std::vector<unsigned char> faceLevels, prevFaceLevels;
+   std::vector<unsigned> faceEdges, prevFaceEdges;
+   std::vector<unsigned> faceOffsets, prevFaceOffsets;
+
+   Program progCompute, progEstimate, progCopy, progDraw, progLines;
+   Program progPatches, progPatchLines;
+   Program progBounds, progCull;
+
+   Buffer bufVertices[2]; // current and previous
+   int curVertices;
+
+   Buffer bufBasis, bufFaceInfo;
+   Buffer bufBucketFaces, bufFaceOffsets, bufFaceEdges;
+   Buffer bufTessFaces, bufCopies, bufFaceTessLevels;
+   Buffer bufFaceBounds, bufVisibleFaces, bufCullCommands, bufFaceVisible;
+   Buffer bufIndices[MaxLevels], bufLineIndices[MaxLevels];
 
    GLuint vao;
 
-   void makeQuadFaceIndexBuffers(int level);
+   void estimate();
+   void findEdges();
+   int faceLevel(const FaceInfo &info) const;
+   int viewLevel(const FaceInfo &info, const glm::mat4 &mvp,
+                 const Buffer &bufPartMat, int rank, const int viewport[4]) const;
+   void chooseLevels(const glm::mat4 *mvp, const Buffer *bufPartMat);
+   void update();
+   void cull(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+             const Buffer &bufPartMat, int phase);
+   void drawFaces(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+                  const Buffer &bufPartMat, bool lines);
+   void drawPatches(const glm::mat4 &mvp, const glm::vec4 &clipPlane,
+                    const Buffer &bufPartMat, bool lines);
 };
 
 
+/** Create index buffers for a quad face (or any 2D grid) tesselated into
+ *  sqr(level+1) vertices: 2*sqr(level) triangles and 4*level boundary line
+ *  segments. The buffers contain indices relative to one instance. */
+void makeQuadFaceIndexBuffers(int level, Buffer &triangles, Buffer &lines);
+
+
 #endif // hogtess_surface_hpp_included__
@@ -1,7 +1,9 @@
 #line 2
 
-// TODO: group size 32 in Z
-layout(local_size_x = 1,
+// LOCAL_SIZE is chosen by the host from GL_MAX_COMPUTE_WORK_GROUP_* limits,
+// each work group tesselates FACES consecutive faces of a bucket (all faces
+// in a bucket have the same level)
+layout(local_size_x = LOCAL_SIZE,
        local_size_y = 1,
        local_size_z = 1) in;
 
@@ -15,32 +17,129 @@ layout(std430, binding = 1) buffer vertexBuffer
     vec4 vertices[];
 };
 
+// Lagrange basis at the tesselation points, basis[t*(P+1) + i]
+layout(std430, binding = 2) buffer basisBuffer
+{
+    float basis[];
+};
+
+// faces of all buckets, faces of bucket k start at 'firstFace'
+layout(std430, binding = 3) buffer bucketBuffer
+{
+    uint bucketFaces[];
+};
+
+// start of each face in the vertex buffer
+layout(std430, binding = 4) buffer offsetBuffer
+{
+    uint faceOffsets[];
+};
+
+// levels of the 4 edges of each face (v = 0, u = 1, v = 1, u = 0), 8 bits
+// each, may be coarser than the face level where the neighbor is coarser
+layout(std430, binding = 5) buffer edgeBuffer
+{
+    uint faceEdges[];
+};
+
 uniform int level;
-uniform float invLevel;
+uniform int numFaces;    // in this bucket
+uniform int firstFace;   // in bucketFaces
+uniform int basisOffset; // of this level's table in basis[]
+
+const int N1 = P+1;
+const int ndof = N1*N1;
 
+// shape functions at the tesselation points, shape[t*N1 + i]
+shared float shape[(MAX_LEVEL+1)*N1];
+
+shared vec4 faceCoefs[FACES*ndof];
+shared vec4 partial[FACES*N1*(MAX_LEVEL+1)];
+
+// contract U: the vertex (tessX, tessY) of 'face' (within the group)
+vec4 evalVertex(uint face, uint tessX, uint tessY, uint level1)
+{
+   vec4 value = vec4(0.0);
+   for (int i = 0; i < N1; i++) {
+      value += partial[(face*N1 + i)*level1 + tessY] * shape[tessX*N1 + i];
+   }
+   return value;
+}
+
+// Sum-factorized evaluation: the coefficients of each face are first
+// contracted in V for all tesselation rows, then in U.
 void main()
 {
-   const int ndof = (P+1)*(P+1);
-   const int ntess = (level+1)*(level+1);
+   uint level1 = level+1;
+   uint ntess = level1*level1;
 
-   uint faceIdx = gl_GlobalInvocationID.z;
-   uint tessX = gl_GlobalInvocationID.x;
-   uint tessY = gl_GlobalInvocationID.y;
+   uint groupFirst = gl_WorkGroupID.x * FACES;
+   uint nfaces = min(uint(FACES), uint(numFaces) - groupFirst);
 
-   float u = tessX * invLevel;
-   float v = tessY * invLevel;
+   for (uint n = gl_LocalInvocationID.x; n < level1*N1; n += LOCAL_SIZE)
+   {
+      shape[n] = basis[basisOffset + n];
+   }
 
-   float ushape[P+1], vshape[P+1];
-   lagrangeShape(u, ushape);
-   lagrangeShape(v, vshape);
+   // load the coefficients of all faces of the group once
+   for (uint i = gl_LocalInvocationID.x; i < nfaces*ndof; i += LOCAL_SIZE)
+   {
+      uint face = bucketFaces[firstFace + groupFirst + i / ndof];
+      faceCoefs[i] = coefs[face*ndof + i % ndof];
+   }
+   barrier();
 
-   vec4 value = vec4(0.0);
-   for (int i = 0; i <= P; i++)
-   for (int j = 0; j <= P; j++)
+   // contract V: partial[face][i][ty] = sum_j C[face][i][j] * shape_j(v)
+   for (uint n = gl_LocalInvocationID.x; n < nfaces*N1*level1; n += LOCAL_SIZE)
    {
-       vec4 coef = coefs[faceIdx*ndof + (P+1)*i + j];
-       value += ushape[i]*vshape[j]*coef;
+      uint fi = n / level1, ty = n % level1;
+
+      vec4 sum = vec4(0.0);
+      for (int j = 0; j < N1; j++) {
+         sum += faceCoefs[fi*N1 + j] * shape[ty*N1 + j];
+      }
+      partial[n] = sum;
    }
+   barrier();
+
+   // contract U and store the vertices
+   for (uint n = gl_LocalInvocationID.x; n < nfaces*ntess; n += LOCAL_SIZE)
+   {
+      uint face = n / ntess;
+      uint tessX = n % level1;
+      uint tessY = (n / level1) % level1;
+
+      uint globalFace = bucketFaces[firstFace + groupFirst + face];
 
-   vertices[faceIdx*ntess + tessY*(level+1) + tessX] = value;
+      vec4 value = evalVertex(face, tessX, tessY, level1);
+
+      // on an edge with a coarser level, move the vertex onto the coarse
+      // segment so that it matches the neighbor
+      int edge = (tessY == 0) ? 0 : (tessX == level) ? 1 :
+                 (tessY == level) ? 2 : (tessX == 0) ? 3 : -1;
+      if (edge >= 0)
+      {
+         uint edgeLevel = (faceEdges[globalFace] >> (8*edge)) & 0xff;
+         uint along = (edge == 0 || edge == 2) ? tessX : tessY;
+         uint step = level / max(edgeLevel, 1u);
+         uint rem = along % step;
+
+         if (edgeLevel < level && rem != 0)
+         {
+            uint a = along - rem, b = a + step;
+            vec4 va, vb;
+            if (edge == 0 || edge == 2) {
+               va = evalVertex(face, a, tessY, level1);
+               vb = evalVertex(face, b, tessY, level1);
+            }
+            else {
+               va = evalVertex(face, tessX, a, level1);
+               vb = evalVertex(face, tessX, b, level1);
+            }
+            value = mix(va, vb, float(rem) / float(step));
+         }
+      }
+
+      vertices[faceOffsets[globalFace] + tessY*level1 + tessX] = value;
+   }
 }
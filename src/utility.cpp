@@ -1,35 +1,42 @@
 #include <vector>
-#include <chrono>
 #include <memory>
 
 #include <cstring>
 #include <cstdlib>
 #include <cstdarg>
 
-#include "utility.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-namespace chrono = std::chrono;
+#include "utility.hpp"
 
-static std::vector<chrono::time_point<chrono::steady_clock>> timeStack;
 
-void tic()
+void setNumThreads(int n)
 {
-   timeStack.push_back(chrono::steady_clock::now());
+#ifdef _OPENMP
+   if (n > 0) {
+      omp_set_num_threads(n);
+   }
+#endif
 }
 
-double toc()
+int numThreads()
 {
-   auto end = std::chrono::steady_clock::now();
-
-   if (timeStack.empty()) {
-      return -1;
-   }
-   auto start = timeStack.back();
-   timeStack.pop_back();
-
-   std::chrono::duration<double> diff = end-start;
+#ifdef _OPENMP
+   return omp_get_max_threads();
+#else
+   return 1;
+#endif
+}
 
-   return diff.count();
+int threadNum()
+{
+#ifdef _OPENMP
+   return omp_get_thread_num();
+#else
+   return 0;
+#endif
 }
 
 
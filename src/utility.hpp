@@ -24,11 +24,21 @@ inline Int roundUpMultiple(Int x, Int mul)
 }
 
 
-void tic();
-double toc();
+#ifdef _OPENMP
+#define OMP_PRAGMA(x) _Pragma(#x)
+#define OMP(x) OMP_PRAGMA(omp x)
+#else
+#define OMP(x)
+#endif
 
+/// Set the number of threads used by OMP loops (0 = all cores).
+void setNumThreads(int n);
 
-#define OMP(x)
+/// Return the maximum number of threads used by OMP loops.
+int numThreads();
+
+/// Return the index of the calling thread in an OMP parallel region.
+int threadNum();
 
 
 std::string format_str(const char* fmt, ...);
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <stdexcept>
+#include <cmath>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "view.hpp"
+
+
+void initializeRenderState()
+{
+   std::cout << "OpenGL version: " << glGetString(GL_VERSION)
+             << ", renderer: " << glGetString(GL_RENDERER) << std::endl;
+
+   GLint major, minor;
+   glGetIntegerv(GL_MAJOR_VERSION, &major);
+   glGetIntegerv(GL_MINOR_VERSION, &minor);
+
+   if ((10*major + minor) < 43)
+   {
+      throw std::runtime_error(
+         "OpenGL version 4.3 or higher is required to run this program.");
+   }
+
+   glEnable(GL_DEPTH_TEST);
+   glDepthFunc(GL_LEQUAL);
+   glEnable(GL_CULL_FACE);
+   glEnable(GL_MULTISAMPLE);
+}
+
+
+glm::mat4 viewMatrix(double aspect, double rotateX, double rotateY,
+                     double zoom)
+{
+   // set up the projection matrix
+   glm::dmat4 proj = glm::perspective(glm::radians(30.0), aspect, 0.001, 10.0);
+
+   // set up the model view matrix
+   double scale = std::exp(zoom);
+   glm::dmat4 view(1.0);
+   view = glm::translate(view, glm::dvec3(0, 0, -2));
+   view = glm::scale(view, glm::dvec3(scale, scale, scale));
+   view = glm::rotate(view, glm::radians(rotateX), glm::dvec3(1, 0, 0));
+   view = glm::rotate(view, glm::radians(rotateY), glm::dvec3(0, 1, 0));
+   view = glm::rotate(view, glm::radians(-90.0), glm::dvec3(1, 0, 0));
+
+   // final transformation matrix, round to floats
+   return glm::mat4(proj*view);
+}
+
+
+glm::vec4 clipPlaneEquation(double clipX, double clipY, double clipZ)
+{
+   const double speed = 2;
+   double phi = speed*clipY*M_PI/180;
+   double theta = speed*clipX*M_PI/180;
+
+   return glm::vec4(cos(phi)*cos(theta),
+                    sin(phi),
+                    -sin(theta),
+                    -0.005 * clipZ + 1e-6);
+}
+
+
+std::vector<glm::mat4> partMatrices(const Solution &solution, int explode)
+{
+   double scale = std::pow(0.93, explode);
+
+   std::vector<glm::mat4> matrices(solution.numRanks());
+   for (int rank = 0; rank < matrices.size(); rank++)
+   {
+      const double *center = solution.partCenter(rank);
+      glm::dmat4 mat(1.0);
+      mat = glm::translate(mat, glm::dvec3(center[0], center[1], center[2]));
+      mat = glm::scale(mat, glm::dvec3(scale, scale, scale));
+      mat = glm::translate(mat, glm::dvec3(-center[0], -center[1], -center[2]));
+      matrices[rank] = mat;
+   }
+   return matrices;
+}
@@ -0,0 +1,29 @@
+#ifndef hogtess_view_hpp_included__
+#define hogtess_view_hpp_included__
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "input/input.hpp"
+
+
+/* View helpers shared by the interactive RenderWidget and the headless
+   renderer, so that both produce the same image for the same parameters. */
+
+/// Check for OpenGL 4.3 and set up the global render state.
+void initializeRenderState();
+
+/** Projection and model view matrix for the given rotation (degrees) and
+    zoom (logarithmic), rounded to floats. */
+glm::mat4 viewMatrix(double aspect, double rotateX, double rotateY,
+                     double zoom);
+
+/// Clip plane for the given angles and offset, in key press steps.
+glm::vec4 clipPlaneEquation(double clipX, double clipY, double clipZ);
+
+/// Transformations of the parts (ranks) for the given explode level.
+std::vector<glm::mat4> partMatrices(const Solution &solution, int explode);
+
+
+#endif // hogtess_view_hpp_included__